@@ -0,0 +1,252 @@
+;;;; Bounded MPMC queues on a preallocated ring buffer, after Dmitry
+;;;; Vyukov's "Bounded MPMC queue".
+;;;;
+;;;; Each cell of the ring has a sequence number telling whether it is
+;;;; ready for the producer or the consumer whose turn it is: producers
+;;;; and consumers claim positions with a CAS, then hand the cell over by
+;;;; storing the next sequence number. Nothing is allocated per element.
+;;;;
+;;;; This software is part of the SBCL system. See the README file for
+;;;; more information.
+;;;;
+;;;; This software is derived from the CMU CL system, which was written at
+;;;; Carnegie Mellon University and released into the public domain. The
+;;;; software is in the public domain and is provided with absolutely no
+;;;; warranty. See the COPYING and CREDITS files for more information.
+
+(in-package :sb-concurrency)
+
+(defconstant +takers+ 0)
+(defconstant +putters+ 1)
+
+(defstruct (bounded-queue (:constructor %make-bounded-queue
+                              (capacity name
+                               &aux (elements (make-array capacity))
+                                    (sequences
+                                     (let ((sequences
+                                             (make-array capacity
+                                                         :element-type 'fixnum)))
+                                       (dotimes (i capacity sequences)
+                                         (setf (aref sequences i) i))))))
+                          (:copier nil)
+                          (:predicate bounded-queue-p))
+  "Thread safe FIFO queue of a fixed capacity, on a preallocated ring
+buffer.
+
+Use PUT and TRY-PUT to add objects to the queue, and TAKE and TRY-TAKE to
+remove them. PUT and TAKE wait while the queue is full or empty, TRY-PUT and
+TRY-TAKE return at once."
+  (capacity 0 :type (and fixnum unsigned-byte) :read-only t)
+  (elements (missing-arg) :type simple-vector :read-only t)
+  ;; The cell at position P, modulo CAPACITY, is ready for the producer
+  ;; putting at P when its sequence number is P, and for the consumer
+  ;; taking from P when it is P + 1.
+  (sequences (missing-arg) :type (simple-array fixnum (*)) :read-only t)
+  (put-position 0 :type fixnum)
+  (take-position 0 :type fixnum)
+  ;; Threads in PUT or TAKE wait on these while the queue is full or
+  ;; empty. WAITERS counts them, takers first, so that the other side
+  ;; only takes MUTEX when somebody is waiting.
+  (mutex (make-mutex :name "bounded queue lock") :type mutex :read-only t)
+  (not-empty (make-waitqueue :name "bounded queue not empty") :read-only t)
+  (not-full (make-waitqueue :name "bounded queue not full") :read-only t)
+  (waiters (make-array 2 :element-type 'sb-ext:word :initial-element 0)
+   :type (simple-array sb-ext:word (2))
+   :read-only t)
+  (name nil))
+
+(setf (documentation 'bounded-queue-p 'function)
+      "Returns true if argument is a BOUNDED-QUEUE, NIL otherwise."
+      (documentation 'bounded-queue-name 'function)
+      "Name of a BOUNDED-QUEUE. SETFable."
+      (documentation 'bounded-queue-capacity 'function)
+      "Number of objects a BOUNDED-QUEUE can hold.")
+
+(defmethod print-object ((queue bounded-queue) stream)
+  (print-unreadable-object (queue stream :type t :identity t)
+    (format stream "~@[~S ~](~D/~D)"
+            (bounded-queue-name queue)
+            (bounded-queue-count queue)
+            (bounded-queue-capacity queue))))
+
+(defun make-bounded-queue (capacity &key name initial-contents)
+  "Returns a new BOUNDED-QUEUE with NAME, holding up to CAPACITY objects,
+rounded up to a power of two, with the contents of the INITIAL-CONTENTS
+sequence put into it."
+  (declare (type (integer 1 #.(ash most-positive-fixnum -1)) capacity))
+  (let ((queue (%make-bounded-queue (ash 1 (integer-length (1- capacity)))
+                                    name)))
+    (flet ((put-1 (x)
+             (unless (try-put x queue)
+               (error "~S has more than ~D elements."
+                      'initial-contents (bounded-queue-capacity queue)))))
+      (declare (dynamic-extent #'put-1))
+      (map nil #'put-1 initial-contents))
+    queue))
+
+;;; Called after changing QUEUE so that the side WHICH may be able to
+;;; proceed. A waiter counts itself and then tries again, so either it
+;;; sees our change or we see it. LOCKEDP says that the caller, being a
+;;; waiter itself, already holds the mutex.
+(defun wake-bounded-queue-waiters (queue which &optional lockedp)
+  (barrier (:memory))
+  (when (plusp (aref (bounded-queue-waiters queue) which))
+    (flet ((broadcast ()
+             ;; Not CONDITION-NOTIFY: the one it woke might time out
+             ;; instead.
+             (condition-broadcast (if (eql which +takers+)
+                                      (bounded-queue-not-empty queue)
+                                      (bounded-queue-not-full queue)))))
+      (if lockedp
+          (broadcast)
+          (with-mutex ((bounded-queue-mutex queue))
+            (broadcast))))))
+
+(defun try-put (value queue)
+  "Adds VALUE to the end of QUEUE if it isn't full. Returns true if VALUE
+was added, NIL otherwise."
+  (%try-put value queue nil))
+
+(defun %try-put (value queue lockedp)
+  (let* ((sequences (bounded-queue-sequences queue))
+         (mask (1- (bounded-queue-capacity queue)))
+         (position (bounded-queue-put-position queue)))
+    (declare (fixnum position))
+    (loop
+      (let* ((sequence (aref sequences (logand position mask)))
+             (diff (- sequence position)))
+        (cond ((zerop diff)
+               (let ((old (compare-and-swap (bounded-queue-put-position queue)
+                                            position (1+ position))))
+                 (when (eql old position)
+                   (return))
+                 (setf position old)))
+              ((minusp diff)
+               ;; The consumer of the previous round hasn't taken it.
+               (return-from %try-put nil))
+              (t
+               (setf position (bounded-queue-put-position queue))))))
+    (let ((index (logand position mask)))
+      (setf (svref (bounded-queue-elements queue) index) value)
+      (barrier (:write))
+      (setf (aref sequences index) (1+ position)))
+    (wake-bounded-queue-waiters queue +takers+ lockedp)
+    t))
+
+(defun try-take (queue)
+  "Removes the oldest object from QUEUE and returns it as the primary value,
+and T as secondary value. If QUEUE is empty, returns NIL as both primary and
+secondary value."
+  (%try-take queue nil))
+
+(defun %try-take (queue lockedp)
+  (let* ((sequences (bounded-queue-sequences queue))
+         (capacity (bounded-queue-capacity queue))
+         (mask (1- capacity))
+         (position (bounded-queue-take-position queue)))
+    (declare (fixnum position))
+    (loop
+      (let* ((sequence (aref sequences (logand position mask)))
+             (diff (- sequence (1+ position))))
+        (cond ((zerop diff)
+               (let ((old (compare-and-swap (bounded-queue-take-position queue)
+                                            position (1+ position))))
+                 (when (eql old position)
+                   (return))
+                 (setf position old)))
+              ((minusp diff)
+               ;; Empty, or its producer hasn't filled it yet.
+               (return-from %try-take (values nil nil)))
+              (t
+               (setf position (bounded-queue-take-position queue))))))
+    (barrier (:read))
+    (let* ((index (logand position mask))
+           (elements (bounded-queue-elements queue))
+           (value (svref elements index)))
+      ;; Don't keep VALUE alive until the cell is reused.
+      (setf (svref elements index) nil)
+      (barrier (:write))
+      (setf (aref sequences index) (+ position capacity))
+      (wake-bounded-queue-waiters queue +putters+ lockedp)
+      (values value t))))
+
+;;; Calls TRY until it succeeds, sleeping while it fails, for at most
+;;; TIMEOUT seconds. Returns the values of the last call. TRY is passed
+;;; whether it is called with the mutex held.
+(defun wait-on-bounded-queue (queue which try timeout)
+  (declare (function try))
+  (let ((mutex (bounded-queue-mutex queue))
+        (waitqueue (if (eql which +takers+)
+                       (bounded-queue-not-empty queue)
+                       (bounded-queue-not-full queue)))
+        (waiters (bounded-queue-waiters queue))
+        (deadline (when timeout
+                    (+ (get-internal-real-time)
+                       (round (* timeout internal-time-units-per-second))))))
+    (with-mutex (mutex)
+      ;; Atomically, as we may leave without the mutex on timeout.
+      (atomic-incf (aref waiters which))
+      (barrier (:memory))
+      (unwind-protect
+           (loop
+             (multiple-value-bind (value ok) (funcall try t)
+               (when ok
+                 (return (values value ok))))
+             (let ((remaining
+                     (when deadline
+                       (/ (- deadline (get-internal-real-time))
+                          (float internal-time-units-per-second)))))
+               (when (and remaining (<= remaining 0))
+                 (return (values nil nil)))
+               (unless (condition-wait waitqueue mutex :timeout remaining)
+                 ;; Timed out, and doesn't hold MUTEX.
+                 (return (funcall try nil)))))
+        (atomic-decf (aref waiters which))))))
+
+(defun put (value queue &key timeout)
+  "Adds VALUE to the end of QUEUE, waiting while QUEUE is full. If TIMEOUT
+is given, waits at most that many seconds. Returns true if VALUE was added,
+NIL otherwise."
+  (or (try-put value queue)
+      (flet ((try (lockedp)
+               (values nil (%try-put value queue lockedp))))
+        (declare (dynamic-extent #'try))
+        (nth-value 1 (wait-on-bounded-queue queue +putters+ #'try timeout)))))
+
+(defun take (queue &key timeout)
+  "Removes the oldest object from QUEUE and returns it as the primary value,
+and T as secondary value, waiting while QUEUE is empty. If TIMEOUT is given
+and no object arrives within that many seconds, returns NIL as both primary
+and secondary value."
+  (multiple-value-bind (value ok) (try-take queue)
+    (if ok
+        (values value t)
+        (flet ((try (lockedp)
+                 (%try-take queue lockedp)))
+          (declare (dynamic-extent #'try))
+          (wait-on-bounded-queue queue +takers+ #'try timeout)))))
+
+(defun bounded-queue-count (queue)
+  "Returns the number of objects in QUEUE. The count may be out of date by
+the time it is returned."
+  (let ((take (bounded-queue-take-position queue)))
+    (barrier (:read))
+    (max 0 (min (bounded-queue-capacity queue)
+                (- (bounded-queue-put-position queue) take)))))
+
+(defun bounded-queue-empty-p (queue)
+  "Returns T if QUEUE is empty, NIL otherwise."
+  (zerop (bounded-queue-count queue)))
+
+(defun list-bounded-queue-contents (queue)
+  "Returns the contents of QUEUE as a list without removing them from the
+QUEUE. Mainly useful for manual examination of queue state, as the list may
+be out of date by the time it is returned."
+  (let ((sequences (bounded-queue-sequences queue))
+        (elements (bounded-queue-elements queue))
+        (mask (1- (bounded-queue-capacity queue))))
+    (loop for position from (bounded-queue-take-position queue)
+            below (bounded-queue-put-position queue)
+          for index = (logand position mask)
+          when (eql (aref sequences index) (1+ position))
+            collect (svref elements index))))
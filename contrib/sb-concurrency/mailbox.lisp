@@ -15,18 +15,38 @@
 
 ;; TODO: type and values decls
 
-(defstruct (mailbox (:constructor %make-mailbox (queue semaphore name))
+;;; Receivers claim messages by decrementing the count of unclaimed
+;;; messages, and then dequeue exactly as many as they claimed. A
+;;; receiver finding nothing to claim counts itself as a waiter and
+;;; sleeps; senders only go to the trouble of waking somebody up when
+;;; there is a waiter.
+
+(defstruct (mailbox (:constructor %make-mailbox (queue %count name))
                     (:copier nil)
                     (:predicate mailboxp))
   "Mailbox aka message queue.
 
 SEND-MESSAGE adds a message to the mailbox, RECEIVE-MESSAGE waits till
 a message becomes available, whereas RECEIVE-MESSAGE-NO-HANG is a non-blocking
-variant, and RECEIVE-PENDING-MESSAGES empties the entire mailbox in one go.
+variant, RECEIVE-PENDING-MESSAGES empties the entire mailbox in one go, and
+RECEIVE-MESSAGES-INTO fills a vector with as many messages as are available
+after waiting for one.
 
-Messages can be arbitrary objects"
-  (queue (missing-arg) :type queue)
-  (semaphore (missing-arg) :type semaphore)
+Messages can be arbitrary objects. A mailbox made with a CAPACITY holds at
+most that many messages, in a BOUNDED-QUEUE which doesn't allocate per
+message, and SEND-MESSAGE waits while it is full."
+  (queue (missing-arg) :type (or queue bounded-queue))
+  ;; Number of messages in QUEUE which no receiver has claimed yet.
+  (%count 0 :type (and fixnum unsigned-byte))
+  ;; Number of receivers asleep or about to sleep.
+  (waiters 0 :type sb-ext:word)
+  ;; Changed by senders waking receivers, which sleep on it.
+  #+sb-futex
+  (token 0 :type fixnum)
+  #-sb-futex
+  (mutex (make-mutex :name "mailbox lock") :type mutex :read-only t)
+  #-sb-futex
+  (waitqueue (make-waitqueue :name "mailbox waitqueue") :read-only t)
   (name nil))
 
 (setf (documentation 'mailboxp 'function)
@@ -34,16 +54,26 @@ Messages can be arbitrary objects"
       (documentation 'mailbox-name 'function)
       "Name of a MAILBOX. SETFable.")
 
-(defun make-mailbox (&key name initial-contents)
-  "Returns a new MAILBOX with messages in INITIAL-CONTENTS enqueued."
+#+sb-futex
+(sb-kernel:define-structure-slot-addressor mailbox-token-address
+    :structure mailbox
+    :slot token)
+
+(defun make-mailbox (&key name initial-contents capacity)
+  "Returns a new MAILBOX with messages in INITIAL-CONTENTS enqueued. If
+CAPACITY is given, the mailbox holds at most that many messages, rounded up
+to a power of two."
   (flet ((genname (thing name)
            (format nil "~:[Mailbox ~A~;~A for mailbox ~S~]" name thing name)))
-    (%make-mailbox (make-queue
-                    :name (genname "Queue" name)
-                    :initial-contents initial-contents)
-                   (make-semaphore
-                    :name (genname "Semaphore" name)
-                    :count (length initial-contents))
+    (%make-mailbox (if capacity
+                       (make-bounded-queue
+                        capacity
+                        :name (genname "Queue" name)
+                        :initial-contents initial-contents)
+                       (make-queue
+                        :name (genname "Queue" name)
+                        :initial-contents initial-contents))
+                   (length initial-contents)
                    name)))
 
 (defmethod print-object ((mailbox mailbox) stream)
@@ -55,7 +85,8 @@ Messages can be arbitrary objects"
 
 (defun mailbox-count (mailbox)
   "Returns the number of messages currently in the mailbox."
-  (semaphore-count (mailbox-semaphore mailbox)))
+  (barrier (:read)
+    (mailbox-%count mailbox)))
 
 (defun mailbox-empty-p (mailbox)
   "Returns true if MAILBOX is currently empty, NIL otherwise."
@@ -64,13 +95,131 @@ Messages can be arbitrary objects"
 (defun list-mailbox-messages (mailbox)
   "Returns a fresh list containing all the messages in the
 mailbox. Does not remove messages from the mailbox."
-  (list-queue-contents (mailbox-queue mailbox)))
+  (let ((queue (mailbox-queue mailbox)))
+    (etypecase queue
+      (queue (list-queue-contents queue))
+      (bounded-queue (list-bounded-queue-contents queue)))))
+
+;;; Removes a message from the queue of a mailbox, where the caller has
+;;; claimed one. A bounded queue may still be waiting for the sender of
+;;; the oldest message to finish storing it, while a younger one is
+;;; complete and counted.
+(declaim (inline mailbox-dequeue))
+(defun mailbox-dequeue (queue)
+  (if (bounded-queue-p queue)
+      (loop
+        (multiple-value-bind (value ok) (try-take queue)
+          (when ok
+            (return (values value t))))
+        (spin-loop-hint))
+      (dequeue queue)))
+
+;;; Claims up to N messages of MAILBOX, returning how many.
+(declaim (inline claim-messages))
+(defun claim-messages (mailbox n)
+  (declare (type (integer 1) n))
+  (loop
+    (let ((count (mailbox-%count mailbox)))
+      (when (zerop count)
+        (return 0))
+      (let ((claim (min n count)))
+        (when (eql count (compare-and-swap (mailbox-%count mailbox)
+                                           count (- count claim)))
+          (return claim))))))
+
+(defun wake-receiver (mailbox)
+  (barrier (:memory))
+  (unless (zerop (mailbox-waiters mailbox))
+    #+sb-futex
+    (progn
+      (atomic-update (mailbox-token mailbox)
+                     (lambda (token)
+                       (logand (1+ token) most-positive-fixnum)))
+      (sb-sys:with-pinned-objects (mailbox)
+        (sb-thread::futex-wake (mailbox-token-address mailbox) 1)))
+    #-sb-futex
+    (with-mutex ((mailbox-mutex mailbox))
+      ;; Not CONDITION-NOTIFY: the one it woke might time out instead.
+      (condition-broadcast (mailbox-waitqueue mailbox)))))
+
+;;; Claims up to N messages of MAILBOX, waiting for at least one for at
+;;; most TIMEOUT seconds. Returns how many it claimed. Must be called
+;;; with interrupts disabled, so that claimed messages aren't lost.
+(defun wait-for-messages (mailbox n timeout)
+  (let ((claimed (claim-messages mailbox n)))
+    (if (plusp claimed)
+        claimed
+        (sb-sys:allow-with-interrupts
+          (park-receiver mailbox n timeout)))))
+
+#+sb-futex
+(defun park-receiver (mailbox n timeout)
+  (multiple-value-bind (to-sec to-usec stop-sec stop-usec)
+      (sb-impl::decode-timeout timeout)
+    (atomic-incf (mailbox-waiters mailbox))
+    (unwind-protect
+         (loop
+           ;; Read the token before looking for messages: a sender
+           ;; arriving after that changes it, and FUTEX-WAIT returns
+           ;; at once.
+           (let ((token (mailbox-token mailbox)))
+             (barrier (:memory))
+             (let ((claimed (claim-messages mailbox n)))
+               (when (plusp claimed)
+                 (return claimed)))
+             (when (and stop-sec (zerop to-sec) (zerop to-usec))
+               (return 0))
+             (when (eql 1 (sb-sys:with-pinned-objects (mailbox)
+                            (sb-thread::futex-wait
+                             (mailbox-token-address mailbox)
+                             (sb-kernel:get-lisp-obj-address token)
+                             (or to-sec -1)
+                             (or to-usec 0))))
+               ;; 1 = ETIMEDOUT
+               (return (claim-messages mailbox n)))
+             (when stop-sec
+               (setf (values to-sec to-usec)
+                     (sb-impl::relative-decoded-times stop-sec stop-usec)))))
+      (atomic-decf (mailbox-waiters mailbox)))))
+
+#-sb-futex
+(defun park-receiver (mailbox n timeout)
+  (let ((mutex (mailbox-mutex mailbox))
+        (deadline (when timeout
+                    (+ (get-internal-real-time)
+                       (round (* timeout internal-time-units-per-second))))))
+    (with-mutex (mutex)
+      ;; Atomically, as we may leave without the mutex on timeout.
+      (atomic-incf (mailbox-waiters mailbox))
+      (barrier (:memory))
+      (unwind-protect
+           (loop
+             (let ((claimed (claim-messages mailbox n)))
+               (when (plusp claimed)
+                 (return claimed)))
+             (let ((remaining
+                     (when deadline
+                       (/ (- deadline (get-internal-real-time))
+                          (float internal-time-units-per-second)))))
+               (when (and remaining (<= remaining 0))
+                 (return 0))
+               (unless (condition-wait (mailbox-waitqueue mailbox) mutex
+                                       :timeout remaining)
+                 ;; Timed out, and doesn't hold MUTEX.
+                 (return (claim-messages mailbox n)))))
+        (atomic-decf (mailbox-waiters mailbox))))))
 
 (defun send-message (mailbox message)
-  "Adds a MESSAGE to MAILBOX. Message can be any object."
-  (sb-sys:without-interrupts
-    (enqueue message (mailbox-queue mailbox))
-    (signal-semaphore (mailbox-semaphore mailbox))))
+  "Adds a MESSAGE to MAILBOX. Message can be any object. If MAILBOX was
+made with a CAPACITY and is full, waits until a message is received."
+  (let ((queue (mailbox-queue mailbox)))
+    (sb-sys:without-interrupts
+      (if (bounded-queue-p queue)
+          (sb-sys:allow-with-interrupts
+            (put message queue))
+          (enqueue message queue))
+      (atomic-update (mailbox-%count mailbox) #'1+)
+      (wake-receiver mailbox))))
 
 (defun receive-message (mailbox &key timeout)
   "Removes the oldest message from MAILBOX and returns it as the primary
@@ -80,38 +229,33 @@ arrives.
 If TIMEOUT is provided, and no message arrives within the specified interval,
 returns primary and secondary value of NIL."
   (tagbody
-     ;; Disable interrupts for keeping semaphore count in sync with
-     ;; #msgs in the mailbox.
+     ;; Disable interrupts for keeping the count in sync with #msgs in
+     ;; the mailbox.
      (sb-sys:without-interrupts
-       (sb-sys:allow-with-interrupts
-         (or (wait-on-semaphore (mailbox-semaphore mailbox) :timeout timeout)
-             (return-from receive-message (values nil nil))))
-       (multiple-value-bind (value ok) (dequeue (mailbox-queue mailbox))
+       (when (zerop (wait-for-messages mailbox 1 timeout))
+         (return-from receive-message (values nil nil)))
+       (multiple-value-bind (value ok) (mailbox-dequeue (mailbox-queue mailbox))
          (if ok
              (return-from receive-message (values value t))
              (go :error))))
    :error
-     (sb-int:bug "Mailbox ~S empty after WAIT-ON-SEMAPHORE."
-                 mailbox)))
+     (sb-int:bug "Mailbox ~S empty after claiming a message." mailbox)))
 
 (defun receive-message-no-hang (mailbox)
   "The non-blocking variant of RECEIVE-MESSAGE. Returns two values,
 the message removed from MAILBOX, and a flag specifying whether a
 message could be received."
-  (prog ((semaphore (mailbox-semaphore mailbox))
-         (queue     (mailbox-queue mailbox)))
+  (prog ((queue (mailbox-queue mailbox)))
      ;; Disable interrupts, v.s.
      (sb-sys:without-interrupts
-       (unless (sb-sys:allow-with-interrupts
-                 (sb-thread::try-semaphore semaphore))
+       (when (zerop (claim-messages mailbox 1))
          (return (values nil nil)))
-       (multiple-value-bind (value ok) (dequeue queue)
+       (multiple-value-bind (value ok) (mailbox-dequeue queue)
          (if ok
              (return (values value t))
              (go :error))))
    :error
-     (sb-int:bug "Mailbox ~S empty after successfull TRY-SEMAPHORE."
-                 mailbox)))
+     (sb-int:bug "Mailbox ~S empty after claiming a message." mailbox)))
 
 (defun receive-pending-messages (mailbox &optional n)
   "Removes and returns all (or at most N) currently pending messages
@@ -121,41 +265,54 @@ Note: Concurrent threads may be snarfing messages during the run of
 this function, so even though X,Y appear right next to each other in
 the result, does not necessarily mean that Y was the message sent
 right after X."
-  (prog* ((msgs  '())
-          (sem   (mailbox-semaphore mailbox))
-          (queue (mailbox-queue mailbox))
-          (avail (mailbox-count mailbox))
-          (count (if n (min n avail) avail)))
-     (when (zerop count)
-       (go :finish))
+  (prog ((msgs  '())
+         (queue (mailbox-queue mailbox)))
+     (when (eql n 0)
+       (return nil))
      ;; Disable interrupts, v.s.
      (sb-sys:without-interrupts
-       (unless (sb-sys:allow-with-interrupts
-                 (sb-thread::try-semaphore sem count))
-         (go :slow-path))
-       ;; Safe because QUEUE is private; other threads may be snarfing
-       ;; messages under our feet, though, hence the out of order bit
-       ;; in the docstring. Same for the slow path.
-       (loop
-         (multiple-value-bind (msg ok) (dequeue queue)
-           (unless ok (go :error))
-           (push msg msgs)
-           (when (zerop (decf count))
-             (go :finish)))))
-   ;; This is the slow path as RECEIVE-MESSAGE-NO-HANG will have to
-   ;; lock the semaphore's mutex again and again.
-   :slow-path
-     ;; No need for disabling interrupts because we never leave the
-     ;; mailbox in an inconsistent state here.
-     (loop
-       (multiple-value-bind (msg ok)
-           (receive-message-no-hang mailbox)
-         (unless ok (go :finish))
-         (push msg msgs)
-         (when (zerop (decf count))
-           (go :finish))))
-   :finish
-       (return (nreverse msgs))
+       (let ((count (claim-messages mailbox
+                                    (or n most-positive-fixnum))))
+         ;; Other threads may be snarfing messages under our feet,
+         ;; hence the out of order bit in the docstring.
+         (loop repeat count
+               do (multiple-value-bind (msg ok) (mailbox-dequeue queue)
+                    (unless ok (go :error))
+                    (push msg msgs)))))
+     (return (nreverse msgs))
    :error
-       (sb-int:bug "Mailbox ~S empty after successfull TRY-SEMAPHORE."
-                   mailbox)))
+     (sb-int:bug "Mailbox ~S empty after claiming messages." mailbox)))
+
+(defun receive-messages-into (mailbox vector &key (start 0) end timeout)
+  "Removes messages from MAILBOX into VECTOR, from index START up to END,
+oldest first, and returns the number of messages received. If MAILBOX is
+empty, waits until a message arrives, and then receives as many messages as
+are pending and fit, without waiting for more.
+
+If TIMEOUT is provided, and no message arrives within the specified interval,
+returns 0.
+
+Unlike RECEIVE-PENDING-MESSAGES this allocates nothing, and unlike
+RECEIVE-MESSAGE it waits and wakes up at most once per batch. The same
+caveat about the order of messages received concurrently by other threads
+applies as for RECEIVE-PENDING-MESSAGES."
+  (declare (type vector vector) (type sb-int:index start))
+  (let* ((end (or end (length vector)))
+         (queue (mailbox-queue mailbox)))
+    (declare (type sb-int:index end))
+    (unless (<= start end (length vector))
+      (error "Bounding indices ~S and ~S are bad for a vector of length ~S."
+             start end (length vector)))
+    (if (= start end)
+        0
+        (prog (count)
+           ;; Disable interrupts, v.s.
+           (sb-sys:without-interrupts
+             (setf count (wait-for-messages mailbox (- end start) timeout))
+             (loop for i from start below (+ start count)
+                   do (multiple-value-bind (msg ok) (mailbox-dequeue queue)
+                        (unless ok (go :error))
+                        (setf (aref vector i) msg))))
+           (return count)
+         :error
+           (sb-int:bug "Mailbox ~S empty after claiming messages." mailbox)))))
@@ -11,6 +11,8 @@
 
 (defpackage :sb-concurrency
   (:use :cl :sb-thread :sb-int :sb-ext :sb-sys)
+  ;; SB-INT:FORCE forces delayed evaluation, an unrelated thing.
+  (:shadow "FORCE")
   (:export
    ;; MAILBOX
    "LIST-MAILBOX-MESSAGES"
@@ -22,6 +24,7 @@
    "MAKE-MAILBOX"
    "RECEIVE-MESSAGE"
    "RECEIVE-MESSAGE-NO-HANG"
+   "RECEIVE-MESSAGES-INTO"
    "RECEIVE-PENDING-MESSAGES"
    "SEND-MESSAGE"
 
@@ -36,6 +39,20 @@
    "QUEUE-NAME"
    "QUEUEP"
 
+   ;; BOUNDED-QUEUE
+   "BOUNDED-QUEUE"
+   "BOUNDED-QUEUE-CAPACITY"
+   "BOUNDED-QUEUE-COUNT"
+   "BOUNDED-QUEUE-EMPTY-P"
+   "BOUNDED-QUEUE-NAME"
+   "BOUNDED-QUEUE-P"
+   "LIST-BOUNDED-QUEUE-CONTENTS"
+   "MAKE-BOUNDED-QUEUE"
+   "PUT"
+   "TAKE"
+   "TRY-PUT"
+   "TRY-TAKE"
+
    ;; GATE
    "CLOSE-GATE"
    "GATE"
@@ -56,4 +73,20 @@
    "FRLOCK-READ-END"
    "GRAB-FRLOCK-WRITE-LOCK"
    "RELEASE-FRLOCK-WRITE-LOCK"
+
+   ;; THREAD-POOL
+   "AWAIT"
+   "FORCE"
+   "FUTURE"
+   "FUTURE-DONE-P"
+   "FUTUREP"
+   "MAKE-THREAD-POOL"
+   "PMAP"
+   "PREDUCE"
+   "SHUTDOWN-THREAD-POOL"
+   "SUBMIT"
+   "THREAD-POOL"
+   "THREAD-POOL-NAME"
+   "THREAD-POOL-P"
+   "THREAD-POOL-SIZE"
    ))
\ No newline at end of file
@@ -0,0 +1,435 @@
+;;;; Work-stealing thread pools, with futures and parallel MAP and REDUCE.
+;;;;
+;;;; Each worker keeps the tasks it spawns in a deque of its own, after
+;;;; "Dynamic Circular Work-Stealing Deque" by David Chase and Yossi Lev:
+;;;; the worker pushes and pops at the bottom without locking, and idle
+;;;; workers steal from the top with a CAS.
+;;;;
+;;;; This software is part of the SBCL system. See the README file for
+;;;; more information.
+;;;;
+;;;; This software is derived from the CMU CL system, which was written at
+;;;; Carnegie Mellon University and released into the public domain. The
+;;;; software is in the public domain and is provided with absolutely no
+;;;; warranty. See the COPYING and CREDITS files for more information.
+
+(in-package :sb-concurrency)
+
+;;;; Deques
+
+(defstruct (deque (:constructor make-deque ())
+                  (:copier nil))
+  ;; Tasks live at indices from TOP below BOTTOM, each at its index
+  ;; modulo the length of BUFFER, which is a power of two. Only the
+  ;; owning worker changes BOTTOM and BUFFER; thieves advance TOP.
+  (buffer (make-array 64) :type simple-vector)
+  (top 0 :type fixnum)
+  (bottom 0 :type fixnum))
+
+(defun deque-push (task deque)
+  (let* ((bottom (deque-bottom deque))
+         (top (deque-top deque))
+         (buffer (deque-buffer deque))
+         (size (length buffer)))
+    (when (>= (- bottom top) size)
+      ;; Full. Thieves may still be reading the old buffer, so copy
+      ;; rather than move the tasks.
+      (let ((new (make-array (* 2 size))))
+        (loop for i from top below bottom
+              do (setf (svref new (logand i (1- (* 2 size))))
+                       (svref buffer (logand i (1- size)))))
+        (setf buffer new
+              (deque-buffer deque) new)))
+    (setf (svref buffer (logand bottom (1- (length buffer)))) task)
+    (barrier (:write))
+    (setf (deque-bottom deque) (1+ bottom))))
+
+(defun deque-pop (deque)
+  (let* ((bottom (1- (deque-bottom deque)))
+         (buffer (deque-buffer deque)))
+    (setf (deque-bottom deque) bottom)
+    (barrier (:memory))
+    (let ((top (deque-top deque)))
+      (cond ((< bottom top)
+             (setf (deque-bottom deque) top)
+             nil)
+            (t
+             (let ((task (svref buffer (logand bottom (1- (length buffer))))))
+               (unless (< top bottom)
+                 ;; The last task: race the thieves for it.
+                 (unless (eql top (compare-and-swap (deque-top deque)
+                                                    top (1+ top)))
+                   (setf task nil))
+                 (setf (deque-bottom deque) (1+ top)))
+               task))))))
+
+;;; Returns NIL both when DEQUE is empty and when another thread took
+;;; the task first.
+(defun deque-steal (deque)
+  (let ((top (deque-top deque)))
+    (barrier (:memory))
+    (when (< top (deque-bottom deque))
+      (let* ((buffer (deque-buffer deque))
+             (task (svref buffer (logand top (1- (length buffer))))))
+        (when (eql top (compare-and-swap (deque-top deque) top (1+ top)))
+          task)))))
+
+(defun deque-empty-p (deque)
+  (>= (deque-top deque) (deque-bottom deque)))
+
+;;;; Pools and futures
+
+(defstruct (thread-pool (:constructor %make-thread-pool (name size))
+                        (:copier nil)
+                        (:predicate thread-pool-p))
+  "Work-stealing thread pool.
+
+Use SUBMIT to run a function in the pool, FORCE and AWAIT to get its values,
+and PMAP and PREDUCE to map and reduce sequences in parallel. Tasks that
+submit other tasks keep them on their worker's own deque, from which idle
+workers steal them."
+  (name nil)
+  (size 0 :type sb-int:index :read-only t)
+  (workers #() :type simple-vector)
+  (threads '() :type list)
+  ;; Tasks submitted by threads which aren't workers of the pool.
+  (inbox (make-queue) :type queue :read-only t)
+  (mutex (make-mutex :name "thread pool lock") :type mutex :read-only t)
+  ;; Idle workers sleep on WAKEUP until EPOCH changes. SLEEPERS is the
+  ;; number of workers about to sleep or asleep.
+  (wakeup (make-waitqueue :name "thread pool wakeup") :read-only t)
+  (sleepers 0 :type fixnum)
+  (epoch 0 :type fixnum)
+  ;; Threads waiting for a future to finish without being able to help
+  ;; sleep on COMPLETION. AWAITERS is their number.
+  (completion (make-waitqueue :name "thread pool completion") :read-only t)
+  (awaiters 0 :type sb-ext:word)
+  (shutdown-p nil :type boolean))
+
+(setf (documentation 'thread-pool-p 'function)
+      "Returns true if argument is a THREAD-POOL, NIL otherwise."
+      (documentation 'thread-pool-name 'function)
+      "Name of a THREAD-POOL. SETFable."
+      (documentation 'thread-pool-size 'function)
+      "Number of worker threads of a THREAD-POOL.")
+
+(defmethod print-object ((pool thread-pool) stream)
+  (print-unreadable-object (pool stream :type t :identity t)
+    (format stream "~@[~S ~](~D worker~:P~:[~;, shut down~])"
+            (thread-pool-name pool)
+            (thread-pool-size pool)
+            (thread-pool-shutdown-p pool))))
+
+(defstruct (worker (:constructor make-worker (pool index))
+                   (:copier nil))
+  (pool (missing-arg) :type thread-pool :read-only t)
+  (index 0 :type sb-int:index :read-only t)
+  (deque (make-deque) :type deque :read-only t)
+  (random-state (make-random-state t) :read-only t))
+
+;;; The worker running in this thread, if any.
+(defvar *worker* nil)
+
+(defstruct (future (:constructor %make-future (function arguments pool))
+                   (:copier nil)
+                   (:predicate futurep))
+  "Future: the eventual values of a function submitted to a THREAD-POOL
+using SUBMIT. Use FORCE or AWAIT to get them."
+  (function nil :type (or null function))
+  (arguments nil :type list)
+  (pool (missing-arg) :type thread-pool :read-only t)
+  ;; The thread which claims a :PENDING future runs it.
+  (state :pending :type (member :pending :running :done :failed))
+  ;; The list of values when :DONE, the error when :FAILED.
+  (result nil))
+
+(setf (documentation 'futurep 'function)
+      "Returns true if argument is a FUTURE, NIL otherwise.")
+
+(defmethod print-object ((future future) stream)
+  (print-unreadable-object (future stream :type t :identity t)
+    (format stream "~(~A~)" (future-state future))))
+
+(defun future-done-p (future)
+  "Returns true if FUTURE has finished running, either returning values or
+signalling an error."
+  (let ((state (barrier (:read)
+                 (future-state future))))
+    (or (eq state :done) (eq state :failed))))
+
+(defun processor-count ()
+  (sb-alien:alien-funcall
+   (sb-alien:extern-alien "online_processor_count" (function sb-alien:int))))
+
+(defun make-thread-pool (&key name (size #+sb-thread (processor-count)
+                                         #-sb-thread 0))
+  "Returns a new THREAD-POOL with SIZE worker threads, by default one per
+processor. In a pool of size zero, functions submitted to it run when they
+are forced."
+  (declare (type sb-int:index size))
+  (let* ((pool (%make-thread-pool name size))
+         (workers (coerce (loop for i below size
+                                collect (make-worker pool i))
+                          'simple-vector)))
+    (setf (thread-pool-workers pool) workers
+          (thread-pool-threads pool)
+          (loop for worker across workers
+                collect (make-thread #'run-worker
+                                     :name (format nil "~@[~A ~]worker ~D"
+                                                   name (worker-index worker))
+                                     :arguments (list worker))))
+    pool))
+
+(defun shutdown-thread-pool (pool &key (wait t))
+  "Stops the workers of POOL once they have run every task submitted to
+it. If WAIT is true (the default), returns after they have stopped. Signals
+an error if a task submits to POOL after this."
+  (with-mutex ((thread-pool-mutex pool))
+    (setf (thread-pool-shutdown-p pool) t)
+    (bump-epoch pool)
+    (condition-broadcast (thread-pool-wakeup pool)))
+  (when wait
+    (mapc #'join-thread (thread-pool-threads pool)))
+  pool)
+
+(defun bump-epoch (pool)
+  (setf (thread-pool-epoch pool)
+        (logand (1+ (thread-pool-epoch pool)) most-positive-fixnum)))
+
+;;; Called after making a task visible: wakes a sleeping worker if
+;;; there is one. A worker going to sleep counts itself and then looks
+;;; for tasks once more, so either it sees the task or we see it.
+(defun notify-workers (pool)
+  (barrier (:memory))
+  (when (plusp (thread-pool-sleepers pool))
+    (with-mutex ((thread-pool-mutex pool))
+      (bump-epoch pool)
+      (condition-notify (thread-pool-wakeup pool)))))
+
+(defun submit (pool function &rest arguments)
+  "Returns a FUTURE for the values of applying FUNCTION to ARGUMENTS in one
+of the threads of POOL."
+  (when (thread-pool-shutdown-p pool)
+    (error "~S is shut down." pool))
+  (let ((future (%make-future (coerce function 'function) arguments pool))
+        (worker *worker*))
+    (unless (zerop (thread-pool-size pool))
+      (if (and worker (eq pool (worker-pool worker)))
+          (deque-push future (worker-deque worker))
+          (enqueue future (thread-pool-inbox pool)))
+      (notify-workers pool))
+    future))
+
+;;; Runs FUTURE if no other thread has claimed it yet, and returns true
+;;; if it did. The future may also be sitting in a deque or the inbox:
+;;; whoever takes it from there later finds it claimed and skips it.
+(defun run-future (future)
+  (when (eq :pending (compare-and-swap (future-state future) :pending :running))
+    (let ((function (future-function future))
+          (arguments (future-arguments future)))
+      (setf (future-function future) nil
+            (future-arguments future) nil)
+      (let ((result nil)
+            (state nil))
+        (unwind-protect
+             (setf (values result state)
+                   (handler-case
+                       (values (multiple-value-list (apply function arguments))
+                               :done)
+                     (error (error)
+                       (values error :failed))))
+          ;; Also on a throw, ABORT-THREAD or the like, or the future
+          ;; would stay :RUNNING and its waiters would sleep forever.
+          (unless state
+            (setf result (make-condition
+                          'simple-error
+                          :format-control "The function of ~S exited non-locally."
+                          :format-arguments (list future))
+                  state :failed))
+          (setf (future-result future) result)
+          (barrier (:write))
+          (setf (future-state future) state)
+          (let ((pool (future-pool future)))
+            (barrier (:memory))
+            (when (plusp (thread-pool-awaiters pool))
+              (with-mutex ((thread-pool-mutex pool))
+                (condition-broadcast (thread-pool-completion pool))))))))
+    t))
+
+;;; Sleeps until FUTURE is done, or TIMEOUT seconds pass. Returns true
+;;; if it is done.
+(defun wait-for-future (future timeout)
+  (let* ((pool (future-pool future))
+         (mutex (thread-pool-mutex pool))
+         (deadline (when timeout
+                     (+ (get-internal-real-time)
+                        (round (* timeout internal-time-units-per-second))))))
+    (or (future-done-p future)
+        (with-mutex (mutex)
+          ;; Atomically, as we may leave without the mutex on timeout.
+          (atomic-incf (thread-pool-awaiters pool))
+          (barrier (:memory))
+          (unwind-protect
+               (loop until (future-done-p future)
+                     do (let ((remaining
+                                (when deadline
+                                  (/ (- deadline (get-internal-real-time))
+                                     (float internal-time-units-per-second)))))
+                          (when (and remaining (<= remaining 0))
+                            (return nil))
+                          (unless (condition-wait (thread-pool-completion pool)
+                                                  mutex :timeout remaining)
+                            ;; Timed out, and doesn't hold MUTEX.
+                            (return (future-done-p future))))
+                     finally (return t))
+            (atomic-decf (thread-pool-awaiters pool)))))))
+
+(defun find-task (worker)
+  (or (deque-pop (worker-deque worker))
+      (let ((pool (worker-pool worker)))
+        (or (dequeue (thread-pool-inbox pool))
+            (let* ((workers (thread-pool-workers pool))
+                   (n (length workers))
+                   (start (random n (worker-random-state worker))))
+              (dotimes (i n)
+                (let ((victim (svref workers (mod (+ start i) n))))
+                  (unless (eq victim worker)
+                    (let ((task (deque-steal (worker-deque victim))))
+                      (when task
+                        (return task)))))))))))
+
+(defun work-visible-p (pool)
+  (or (not (queue-empty-p (thread-pool-inbox pool)))
+      (loop for worker across (thread-pool-workers pool)
+            thereis (not (deque-empty-p (worker-deque worker))))))
+
+;;; How many times an idle worker looks for a task before sleeping.
+(defconstant +idle-spins+ 64)
+
+;;; Sleeps until a task may be available. Returns NIL if the pool is
+;;; shut down and there are no tasks left.
+(defun park-worker (worker)
+  (let* ((pool (worker-pool worker))
+         (mutex (thread-pool-mutex pool))
+         (epoch (with-mutex (mutex)
+                  (incf (thread-pool-sleepers pool))
+                  (thread-pool-epoch pool))))
+    (barrier (:memory))
+    (unwind-protect
+         (or (work-visible-p pool)
+             (with-mutex (mutex)
+               (loop until (or (thread-pool-shutdown-p pool)
+                               (/= epoch (thread-pool-epoch pool)))
+                     do (condition-wait (thread-pool-wakeup pool) mutex))
+               (not (and (thread-pool-shutdown-p pool)
+                         (not (work-visible-p pool))))))
+      (with-mutex (mutex)
+        (decf (thread-pool-sleepers pool))))))
+
+(defun run-worker (worker)
+  (let ((*worker* worker)
+        (idle 0))
+    (declare (fixnum idle))
+    (loop
+      (let ((task (find-task worker)))
+        (cond (task
+               (run-future task)
+               (setf idle 0))
+              ((< (incf idle) +idle-spins+)
+               (spin-loop-hint))
+              ((park-worker worker)
+               (setf idle 0))
+              (t
+               (return)))))))
+
+(defun finish-future (future)
+  (let ((worker *worker*))
+    (unless (or (future-done-p future)
+                (run-future future))
+      ;; Someone else is running it. Workers of the pool help with other
+      ;; tasks meanwhile, so that waiting for a task spawned by a task
+      ;; never ties a worker up.
+      (when (and worker (eq (future-pool future) (worker-pool worker)))
+        (loop until (future-done-p future)
+              do (let ((task (find-task worker)))
+                   (if task
+                       (run-future task)
+                       (return)))))
+      (wait-for-future future nil))))
+
+(defun force (future)
+  "Returns the values of the function of FUTURE, waiting for them if
+necessary. If the function signalled an error, signals it again, and if it
+exited non-locally otherwise, signals an error.
+
+If the function hasn't started running yet, the calling thread runs it. A
+worker of the pool waiting for the function to finish elsewhere runs other
+tasks of the pool meanwhile."
+  (finish-future future)
+  (let ((result (future-result future)))
+    (if (eq :failed (future-state future))
+        (error result)
+        (values-list result))))
+
+(defun await (future &key timeout)
+  "Waits for FUTURE to finish, or TIMEOUT seconds to pass. Returns true if
+FUTURE finished in time, and NIL otherwise. Unlike FORCE, never runs tasks
+in the calling thread, and so doesn't suit waiting inside a task."
+  (wait-for-future future timeout))
+
+;;;; Parallel MAP and REDUCE
+
+(defun default-grain-size (pool length)
+  ;; A few pieces per worker let stealing even the load out.
+  (max 1 (ceiling length (* 8 (max 1 (thread-pool-size pool))))))
+
+(defun pmap (pool result-type function sequence &key grain-size)
+  "Like MAP with a single SEQUENCE, but calls FUNCTION in the threads of
+POOL, on pieces of GRAIN-SIZE elements at a time. Order of the calls is
+unspecified."
+  (let* ((function (coerce function 'function))
+         (input (coerce sequence 'simple-vector))
+         (length (length input))
+         (output (make-array length))
+         (grain-size (or grain-size (default-grain-size pool length))))
+    (declare (type (integer 1) grain-size))
+    (labels ((map-range (start end)
+               (if (<= (- end start) grain-size)
+                   (loop for i from start below end
+                         do (setf (svref output i)
+                                  (funcall function (svref input i))))
+                   (let* ((middle (floor (+ start end) 2))
+                          (right (submit pool #'map-range middle end)))
+                     (map-range start middle)
+                     (force right)))))
+      (map-range 0 length))
+    (when result-type
+      (coerce output result-type))))
+
+(defun preduce (pool function sequence
+                &key key (initial-value nil initial-value-p) grain-size)
+  "Like REDUCE, but reduces pieces of GRAIN-SIZE elements of SEQUENCE in the
+threads of POOL and combines their results with FUNCTION, which must
+therefore be associative. INITIAL-VALUE, if given, is combined once with the
+result on its left."
+  (let* ((function (coerce function 'function))
+         (input (coerce sequence 'simple-vector))
+         (length (length input))
+         (grain-size (or grain-size (default-grain-size pool length))))
+    (declare (type (integer 1) grain-size))
+    (labels ((reduce-range (start end)
+               (if (<= (- end start) grain-size)
+                   (reduce function input :start start :end end :key key)
+                   (let* ((middle (floor (+ start end) 2))
+                          (right (submit pool #'reduce-range middle end))
+                          (left (reduce-range start middle)))
+                     (funcall function left (force right))))))
+      (cond ((plusp length)
+             (let ((result (reduce-range 0 length)))
+               (if initial-value-p
+                   (funcall function initial-value result)
+                   result)))
+            (initial-value-p
+             initial-value)
+            (t
+             (funcall function))))))
@@ -0,0 +1,57 @@
+;;;; Benchmarks for SB-CONCURRENCY thread pools: the cost of spawning
+;;;; and forcing a trivial task, and how a fine-grained reduction
+;;;; scales with the number of workers.
+;;;;
+;;;; Not part of the test suite. To run it:
+;;;;   sbcl --script pool-bench.lisp
+;;;;
+;;;; This software is part of the SBCL system. See the README file for
+;;;; more information.
+;;;;
+;;;; This software is derived from the CMU CL system, which was written at
+;;;; Carnegie Mellon University and released into the public domain. The
+;;;; software is in the public domain and is provided with absolutely no
+;;;; warranty. See the COPYING and CREDITS files for more information.
+
+(require :sb-concurrency)
+
+(defpackage :sb-concurrency-bench
+  (:use :cl :sb-concurrency))
+
+(in-package :sb-concurrency-bench)
+
+(defun seconds-since (start)
+  (/ (- (get-internal-real-time) start)
+     (float internal-time-units-per-second)))
+
+(defun spawn-bench (&key (n 100000))
+  (let ((pool (make-thread-pool :size 1)))
+    (unwind-protect
+         (flet ((spawn-and-force (pool)
+                  (let ((start (get-internal-real-time)))
+                    (dotimes (i n)
+                      (force (submit pool #'identity i)))
+                    (seconds-since start))))
+           (let ((inside (force (submit pool #'spawn-and-force pool)))
+                 (outside (spawn-and-force pool)))
+             (format t "~&spawn+force: ~,0F ns in a worker, ~,0F ns outside~%"
+                     (/ (* inside 1d9) n) (/ (* outside 1d9) n))))
+      (shutdown-thread-pool pool))))
+
+(defun scaling-bench (&key (length 1000000) (sizes '(1 2 4 8)))
+  (let ((input (make-array length :initial-element 1))
+        (baseline nil))
+    (dolist (size sizes)
+      (let ((pool (make-thread-pool :size size)))
+        (unwind-protect
+             (let* ((start (get-internal-real-time))
+                    (sum (preduce pool #'+ input :grain-size 64))
+                    (seconds (seconds-since start)))
+               (assert (= sum length))
+               (setf baseline (or baseline seconds))
+               (format t "~&preduce, ~D worker~:P: ~,3F s, speedup ~,2F~%"
+                       size seconds (/ baseline (max seconds 1d-6))))
+          (shutdown-thread-pool pool))))))
+
+(spawn-bench)
+(scaling-bench)
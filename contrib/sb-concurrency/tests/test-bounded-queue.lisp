@@ -0,0 +1,136 @@
+;;;; This software is part of the SBCL system. See the README file for
+;;;; more information.
+;;;;
+;;;; This software is derived from the CMU CL system, which was written at
+;;;; Carnegie Mellon University and released into the public domain. The
+;;;; software is in the public domain and is provided with absolutely no
+;;;; warranty. See the COPYING and CREDITS files for more information.
+
+(in-package :sb-concurrency-test)
+
+(deftest bounded-queue.1
+    (let ((q (make-bounded-queue 3 :name 'test-q :initial-contents '(1 2 3))))
+      (values (bounded-queue-name q)
+              (bounded-queue-capacity q)
+              (try-put 4 q)
+              (try-put 5 q)
+              (bounded-queue-count q)
+              (multiple-value-list (try-take q))
+              (list-bounded-queue-contents q)))
+  test-q
+  4
+  t
+  nil
+  4
+  (1 t)
+  (2 3 4))
+
+(deftest bounded-queue.2
+    (let ((q (make-bounded-queue 2)))
+      (values (multiple-value-list (try-take q))
+              (bounded-queue-empty-p q)
+              (put nil q)
+              (multiple-value-list (take q))
+              (multiple-value-list (take q :timeout 0.01))
+              (put 1 q)
+              (put 2 q)
+              (put 3 q :timeout 0.01)
+              (bounded-queue-p q)
+              (bounded-queue-p (make-queue))))
+  (nil nil)
+  t
+  t
+  (nil t)
+  (nil nil)
+  t
+  t
+  nil
+  t
+  nil)
+
+;;; Wrapping around the ring many times keeps FIFO order.
+(deftest bounded-queue.3
+    (let ((q (make-bounded-queue 4)))
+      (loop for i below 1000
+            do (try-put i q)
+            when (>= i 2)
+              do (assert (= (- i 2) (try-take q)))
+            finally (return (list-bounded-queue-contents q))))
+  (998 999))
+
+#+sb-thread
+(deftest bounded-queue.t.1
+    (let* ((q (make-bounded-queue 64))
+           (n 100000)
+           (producers (make-threads 4 "producer"
+                                    (lambda ()
+                                      (dotimes (i n)
+                                        (put i q)))))
+           (consumers (make-threads 4 "consumer"
+                                    (lambda ()
+                                      (let ((sum 0))
+                                        (loop
+                                          (multiple-value-bind (x ok)
+                                              (take q :timeout 1)
+                                            (unless ok
+                                              (return sum))
+                                            (incf sum x))))))))
+      (mapc #'timed-join-thread producers)
+      (values (reduce #'+ (mapcar #'timed-join-thread consumers))
+              (bounded-queue-empty-p q)))
+  19999800000
+  t)
+
+;;; With a single slot, PUT and TAKE mostly succeed only after waiting,
+;;; from inside WAIT-ON-BOUNDED-QUEUE with the mutex held.
+#+sb-thread
+(deftest bounded-queue.t.2
+    (let* ((q (make-bounded-queue 1))
+           (n 10000)
+           (producers (make-threads 2 "producer"
+                                    (lambda ()
+                                      (dotimes (i n)
+                                        (put 1 q)))))
+           (consumers (make-threads 2 "consumer"
+                                    (lambda ()
+                                      (loop while (nth-value 1 (take q :timeout 1))
+                                            count t)))))
+      (mapc #'timed-join-thread producers)
+      (values (reduce #'+ (mapcar #'timed-join-thread consumers))
+              (bounded-queue-empty-p q)))
+  20000
+  t)
+
+(deftest bounded-mailbox.1
+    (let ((mbox (make-mailbox :capacity 4 :initial-contents '(1 2))))
+      (send-message mbox 3)
+      (values (mailbox-count mbox)
+              (list-mailbox-messages mbox)
+              (receive-message mbox)
+              (receive-message-no-hang mbox)
+              (receive-pending-messages mbox)
+              (multiple-value-list (receive-message mbox :timeout 0.01))))
+  3
+  (1 2 3)
+  1
+  2
+  (3)
+  (nil nil))
+
+#+sb-thread
+(deftest bounded-mailbox.t.1
+    (let* ((mbox (make-mailbox :capacity 16))
+           (n 10000)
+           (senders (make-threads 4 "sender"
+                                  (lambda ()
+                                    (dotimes (i n)
+                                      (send-message mbox 1)))))
+           (receivers (make-threads 4 "receiver"
+                                    (lambda ()
+                                      (loop while (receive-message mbox :timeout 1)
+                                            count t)))))
+      (mapc #'timed-join-thread senders)
+      (values (reduce #'+ (mapcar #'timed-join-thread receivers))
+              (mailbox-empty-p mbox)))
+  40000
+  t)
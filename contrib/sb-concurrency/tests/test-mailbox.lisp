@@ -38,6 +38,74 @@
   (3 nil (#\1 #\2 #\3) nil)
   (0 t nil t))
 
+(deftest mailbox-receive-pending.1
+    (let ((mbox (make-mailbox :initial-contents '(1 2 3))))
+      (values (receive-pending-messages mbox 0)
+              (receive-pending-messages mbox 2)
+              (receive-pending-messages mbox)
+              (receive-pending-messages mbox)))
+  nil
+  (1 2)
+  (3)
+  nil)
+
+(deftest mailbox-receive-into.1
+    (let ((mbox (make-mailbox :initial-contents '(1 2 3 4 5)))
+          (vector (make-array 4 :initial-element nil)))
+      (values (receive-messages-into mbox vector :start 1)
+              (copy-seq vector)
+              (receive-messages-into mbox vector :end 1)
+              (copy-seq vector)
+              (mailbox-count mbox)
+              (receive-messages-into mbox vector :timeout 0.01)
+              (receive-messages-into mbox vector :start 2 :end 2)))
+  3
+  #(nil 1 2 3)
+  1
+  #(4 1 2 3)
+  1
+  1
+  0)
+
+(deftest mailbox-receive-into.2
+    (let ((mbox (make-mailbox :capacity 4))
+          (vector (make-array 8)))
+      (send-message mbox :a)
+      (send-message mbox :b)
+      (values (receive-messages-into mbox vector)
+              (subseq vector 0 2)
+              (receive-messages-into mbox vector :timeout 0)
+              (mailbox-empty-p mbox)))
+  2
+  #(:a :b)
+  0
+  t)
+
+#+sb-thread
+(deftest mailbox-receive-into.t.1
+    (let* ((mbox (make-mailbox))
+           (n 10000)
+           (senders (make-threads 4 "sender"
+                                  (lambda ()
+                                    (dotimes (i n)
+                                      (send-message mbox 1)))))
+           (receivers (make-threads 4 "receiver"
+                                    (lambda ()
+                                      (let ((vector (make-array 16))
+                                            (sum 0))
+                                        (loop
+                                          (let ((count (receive-messages-into
+                                                        mbox vector :timeout 1)))
+                                            (when (zerop count)
+                                              (return sum))
+                                            (incf sum (reduce #'+ vector
+                                                              :end count)))))))))
+      (mapc #'timed-join-thread senders)
+      (values (reduce #'+ (mapcar #'timed-join-thread receivers))
+              (mailbox-empty-p mbox)))
+  40000
+  t)
+
 #+sb-thread
 (deftest mailbox-timeouts
     (let* ((mbox (make-mailbox))
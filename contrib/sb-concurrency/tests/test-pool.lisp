@@ -0,0 +1,87 @@
+;;;; This software is part of the SBCL system. See the README file for
+;;;; more information.
+;;;;
+;;;; This software is derived from the CMU CL system, which was written at
+;;;; Carnegie Mellon University and released into the public domain. The
+;;;; software is in the public domain and is provided with absolutely no
+;;;; warranty. See the COPYING and CREDITS files for more information.
+
+(in-package :sb-concurrency-test)
+
+;;; A pool without workers runs tasks as they are forced.
+(deftest pool.0
+    (let* ((pool (make-thread-pool :size 0))
+           (future (submit pool #'floor 7 2))
+           (failing (submit pool #'error "oops")))
+      (values (thread-pool-p pool)
+              (futurep future)
+              (future-done-p future)
+              (multiple-value-list (force future))
+              (future-done-p future)
+              (handler-case (force failing)
+                (simple-error () :error))
+              (pmap pool 'list #'1+ '(1 2 3) :grain-size 1)
+              (preduce pool #'+ #(1 2 3 4 5) :grain-size 2)
+              (preduce pool #'+ '() :initial-value 10)))
+  t t nil (3 1) t :error (2 3 4) 15 10)
+
+;;; A task that leaves without returning still finishes its future.
+(deftest pool.3
+    (let* ((pool (make-thread-pool :size 0))
+           (future (submit pool (lambda () (throw 'pool.3 :thrown)))))
+      (values (catch 'pool.3 (force future))
+              (future-done-p future)
+              (handler-case (force future)
+                (simple-error () :error))))
+  :thrown t :error)
+
+#+sb-thread
+(progn
+
+(defun pfib (pool n)
+  (if (< n 2)
+      n
+      (let ((future (submit pool #'pfib pool (- n 1))))
+        (+ (pfib pool (- n 2)) (force future)))))
+
+(defun fib (n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(deftest pool.1
+    (let ((pool (make-thread-pool :size 4)))
+      (unwind-protect
+           (values (force (submit pool #'pfib pool 20))
+                   (pmap pool 'vector #'fib #(5 10 15 20))
+                   (preduce pool #'+ (loop for i below 10000 collect i)
+                            :grain-size 100)
+                   (await (submit pool #'sleep 0.01) :timeout +timeout+)
+                   (await (submit pool #'sleep 1) :timeout 0.01))
+        (shutdown-thread-pool pool)))
+  6765
+  #(5 55 610 6765)
+  49995000
+  t
+  nil)
+
+;;; Tasks submitted from many threads at once all run exactly once.
+(deftest pool.2
+    (let* ((pool (make-thread-pool :size 4))
+           (counter (make-array 1 :element-type 'sb-ext:word))
+           (submitters
+             (make-threads 8 "submitter"
+                           (lambda ()
+                             (let ((futures
+                                     (loop repeat 1000
+                                           collect (submit pool
+                                                           (lambda ()
+                                                             (sb-ext:atomic-incf
+                                                              (aref counter 0)))))))
+                               (mapc #'force futures))))))
+      (mapc #'timed-join-thread submitters)
+      (shutdown-thread-pool pool)
+      (aref counter 0))
+  8000)
+
+) ;; #+sb-thread (progn ...
@@ -358,6 +358,7 @@ process to continue normally."
   (gc-reinit)
   (foreign-reinit)
   (time-reinit)
+  (sb!c::note-all-code-for-perf-map)
   #!+sb-foreign-thread
   (when (fboundp 'sb!thread:foreign-thread-init)
     (sb!thread:foreign-thread-init))
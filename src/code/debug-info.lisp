@@ -301,7 +301,12 @@
   ;; always careful to put our code in low memory. Is that how it
   ;; works? Would this break if we used a more general memory map? --
   ;; WHN 20000120
-  (fun-map (missing-arg) :type simple-vector :read-only t))
+  (fun-map (missing-arg) :type simple-vector :read-only t)
+  ;; On x86-64 with :SB-GC-SAFEPOINT, the layout of this component's
+  ;; frames at each of its call sites, so that the garbage collector
+  ;; can scan them precisely (see COMPUTE-STACK-MAPS); NIL otherwise.
+  (stack-maps nil :type (or null (simple-array (unsigned-byte 32) (*)))
+                  :read-only t))
 
 (defvar *!initial-debug-sources*)
 
@@ -369,6 +369,30 @@ Note: currently changes to this value are lost when saving core."
   (setf (sb!alien:extern-alien "bytes_consed_between_gcs" os-vm-size-t)
         val))
 
+(defun gc-pause-target ()
+  #!+sb-doc
+  "The length in seconds which garbage collection pauses should aim for, or
+NIL, the default, to leave the garbage collector's tuning alone. When set,
+every garbage collection resizes the nursery (see BYTES-CONSED-BETWEEN-GCS)
+according to how long it took, promotes the survivors of the nursery sooner
+when many of them survive, and raises GENERATION-MINIMUM-AGE-BEFORE-GC of
+older generations which turned out to be mostly live when collected. Can be
+assigned to using SETF. Available on GENCGC platforms only.
+
+Experimental: interface subject to change."
+  #!-gencgc nil
+  #!+gencgc
+  (let ((usec (sb!alien:extern-alien "gencgc_pause_target" sb!alien:int)))
+    (unless (zerop usec)
+      (/ usec 1000000.0))))
+
+(defun (setf gc-pause-target) (seconds)
+  (declare (type (or null (real 0 1000)) seconds))
+  #!+gencgc
+  (setf (sb!alien:extern-alien "gencgc_pause_target" sb!alien:int)
+        (if seconds (max 1 (round (* seconds 1000000))) 0))
+  seconds)
+
 (declaim (inline maybe-handle-pending-gc))
 (defun maybe-handle-pending-gc ()
   (when (and (not *gc-inhibit*)
@@ -400,12 +424,32 @@ Note: currently changes to this value are lost when saving core."
             (number-of-gcs int)
             (number-of-gcs-before-promotion int)
             (cum-sum-bytes-allocated os-vm-size-t)
-            (minimum-age-before-gc unsigned)))
+            (minimum-age-before-gc unsigned)
+            (evacuation-limit os-vm-size-t)))
 
 #!+gencgc
 (define-alien-variable generations
     (array generation #.(1+ sb!vm:+pseudo-static-generation+)))
 
+;;; This too has to agree with gencgc.c, as does the length of the
+;;; gc_events array, GC_EVENT_LOG_SIZE, in GC-EVENTS.
+#!+gencgc
+(define-alien-type gc-event
+    (struct gc-event
+            (number os-vm-size-t)
+            (generation os-vm-size-t)
+            (stop-usec os-vm-size-t)
+            (roots-usec os-vm-size-t)
+            (scavenge-usec os-vm-size-t)
+            (weak-usec os-vm-size-t)
+            (free-usec os-vm-size-t)
+            (total-usec os-vm-size-t)
+            (raised os-vm-size-t)
+            (bytes-before
+             (array os-vm-size-t #.(1+ sb!vm:+pseudo-static-generation+)))
+            (bytes-survived
+             (array os-vm-size-t #.(1+ sb!vm:+pseudo-static-generation+)))))
+
 (macrolet ((def (slot doc &optional setfp)
              (declare (ignorable doc))
              `(progn
@@ -454,6 +498,18 @@ Experimental: interface subject to change."
 automatic promotion to the next generation is triggered. Default is 1. Can be
 assigned to using SETF. Available on GENCGC platforms only.
 
+Experimental: interface subject to change."
+    t)
+  (def evacuation-limit
+      "Maximum number of bytes which collecting GENERATION may copy, or 0 for
+no limit beyond the free space. Collecting a generation normally copies all of
+its live data, so it needs that much free space. When less than that is
+available, or allowed by this limit, only as many pages as fit are evacuated
+and the rest are kept where they are, their garbage surviving until a later
+collection. Successive collections work their way round the generation.
+Default is 0. Can be assigned to using SETF. Available on GENCGC platforms
+only.
+
 Experimental: interface subject to change."
     t)
   (def bytes-allocated
@@ -466,6 +522,47 @@ Experimental: interface subject to change.")
 promotion. Available on GENCGC platforms only.
 
 Experimental: interface subject to change."))
+  (defun gc-events ()
+    "Return a list describing the most recent garbage collections, at most
+64 of them, oldest first. Each is a property list of
+  :NUMBER, counting collections from 0 at startup,
+  :GENERATION, the oldest generation collected,
+  :STOP-THE-WORLD, the time taken to stop the other threads,
+  :ROOTS, the time taken to find the conservative roots and pin pages,
+  :SCAVENGE, the time taken to scavenge and copy everything else,
+  :WEAK, the time taken to process weak objects and weak hash tables,
+  :FREE, the time taken to free and zero the pages collected,
+  :TOTAL, the time the collection took, in all,
+with all times in microseconds, and :GENERATIONS, a list with an entry
+\(GENERATION BYTES-BEFORE BYTES-SURVIVED PROMOTED-P) for each generation
+collected. Returns NIL on platforms other than GENCGC ones.
+
+Experimental: interface subject to change."
+    #!-gencgc nil
+    #!+gencgc
+    (without-gcing
+      (let ((count (extern-alien "gc_event_count" os-vm-size-t))
+            (events (extern-alien "gc_events" (array gc-event 64))))
+        (loop for i from (max 0 (- count 64)) below count
+              collect
+              (let ((event (deref events (mod i 64))))
+                (list :number (slot event 'number)
+                      :generation (slot event 'generation)
+                      :stop-the-world (slot event 'stop-usec)
+                      :roots (slot event 'roots-usec)
+                      :scavenge (slot event 'scavenge-usec)
+                      :weak (slot event 'weak-usec)
+                      :free (slot event 'free-usec)
+                      :total (slot event 'total-usec)
+                      :generations
+                      (loop for gen from 0 to (slot event 'generation)
+                            collect (list gen
+                                          (deref (slot event 'bytes-before)
+                                                 gen)
+                                          (deref (slot event 'bytes-survived)
+                                                 gen)
+                                          (logbitp gen
+                                                   (slot event 'raised))))))))))
   (defun generation-average-age (generation)
     "Average age of memory allocated to GENERATION: average number of times
 objects allocated to the generation have seen younger objects promoted to it.
@@ -47,24 +47,27 @@
   (weakness nil :type (member nil :key :value :key-or-value :key-and-value)
             :read-only t)
   ;; Index into the Next vector chaining together free slots in the KV
-  ;; vector.
+  ;; vector. In an open-addressing table, the number of never-used
+  ;; slots which may still be claimed before the table is rebuilt.
   (next-free-kv 0 :type index)
   ;; A cache that is either nil or is an index into the hash table
   ;; that should be checked first
   (cache nil :type (or null index))
   ;; The index vector. This may be larger than the hash size to help
-  ;; reduce collisions.
+  ;; reduce collisions. Empty in an open-addressing table.
   (index-vector (missing-arg) :type (simple-array sb!vm:word (*)))
   ;; This table parallels the KV vector, and is used to chain together
   ;; the hash buckets and the free list. A slot will only ever be in
-  ;; one of these lists.
+  ;; one of these lists. In an open-addressing table it holds 0 for a
+  ;; slot which has never held an entry since the table was last
+  ;; rebuilt, where probing stops, and 1 otherwise.
   (next-vector (missing-arg) :type (simple-array sb!vm:word (*)))
   ;; This table parallels the KV table, and can be used to store the
-  ;; hash associated with the key, saving recalculation. Could be
-  ;; useful for EQL, and EQUAL hash tables. This table is not needed
-  ;; for EQ hash tables, and when present the value of
+  ;; hash associated with the key, saving recalculation. The value
   ;; +MAGIC-HASH-VECTOR-VALUE+ represents EQ-based hashing on the
-  ;; respective key.
+  ;; respective key. EQ tables don't use the stored hashes for lookup,
+  ;; but keep the table so that the GC only has to ask for a rehash
+  ;; when a key whose hash depends on its address moves.
   (hash-vector nil :type (or null (simple-array sb!vm:word (*))))
   ;; Used for locking GETHASH/(SETF GETHASH)/REMHASH
   (lock (sb!thread:make-mutex :name "hash-table lock")
@@ -76,6 +79,11 @@
   (needs-rehash-p nil :type (member nil t))
   ;; Has user requested synchronization?
   (synchronized-p nil :type (member nil t) :read-only t)
+  ;; If true, keys are found by linear probing through the KV vector,
+  ;; starting at the slot the hash selects, instead of by chaining
+  ;; through the index and next vectors. The GC must know which, so
+  ;; it can cull weak entries.
+  (open-addressing-p nil :type (member nil t) :read-only t)
   ;; For detecting concurrent accesses.
   #!+sb-hash-table-debug
   (signal-concurrent-access t :type (member nil t))
@@ -74,8 +74,26 @@
 #!-sb-fluid (declaim (inline eq-hash))
 (defun eq-hash (key)
   (declare (values hash (member t nil)))
-  (values (pointer-hash key)
-          (oddp (get-lisp-obj-address key))))
+  ;; Symbols and PCL instances carry a hash of their own which doesn't
+  ;; depend on their address, so entries keyed on them don't need to
+  ;; be rehashed when the GC moves the key. Structure instances have
+  ;; no room for one in their header and stay address-based.
+  (macrolet ((stable-or-address (hash)
+               `(let ((hash ,hash))
+                  (if (typep hash 'hash)
+                      (values hash nil)
+                      (values (pointer-hash key) t)))))
+    (cond ((symbolp key)
+           (values (sxhash key) nil))
+          ((and (%instancep key)
+                (layout-for-std-class-p (%instance-layout key)))
+           (stable-or-address (%instance-ref key 2)))
+          ((and (funcallable-instance-p key)
+                (layout-for-std-class-p (%funcallable-instance-layout key)))
+           (stable-or-address (%funcallable-instance-info key 3)))
+          (t
+           (values (pointer-hash key)
+                   (oddp (get-lisp-obj-address key)))))))
 
 #!-sb-fluid (declaim (inline equal-hash))
 (defun equal-hash (key)
@@ -225,7 +243,8 @@ Examples:
                         (rehash-threshold 1)
                         (hash-function nil)
                         (weakness nil)
-                        (synchronized))
+                        (synchronized)
+                        (open-addressing))
   #!+sb-doc
   "Create and return a new hash table. The keywords are as follows:
 
@@ -285,7 +304,15 @@ Examples:
     are safe, but note that CLHS 3.6 (Traversal Rules and Side Effects)
     remains in force. See also: SB-EXT:WITH-LOCKED-HASH-TABLE. This keyword
     argument is experimental, and may change incompatibly or be removed in the
-    future."
+    future.
+
+  :OPEN-ADDRESSING
+    If true, entries are stored directly in a single array of slots and found
+    by probing from the slot their hash selects, instead of being chained
+    through separate bucket vectors, which makes a lookup touch less memory.
+    The table keeps at most three quarters of its slots in use, scaled
+    further down by REHASH-THRESHOLD. This keyword argument is experimental,
+    and may change incompatibly or be removed in the future."
   (declare (type (or function symbol) test))
   (declare (type unsigned-byte size))
   (multiple-value-bind (test test-fun hash-fun)
@@ -363,17 +390,23 @@ Examples:
            (scaled-size (truncate (/ (float size+1) rehash-threshold)))
            (length (power-of-two-ceiling (max scaled-size
                                               (1+ +min-hash-table-size+))))
-           (index-vector (make-array length
+           ;; An open-addressing table probes through CAPACITY slots,
+           ;; numbered from 1 like the KV slots of a chained one.
+           (capacity (when open-addressing
+                       (open-addressing-capacity size rehash-threshold)))
+           (slots (if capacity (1+ capacity) size+1))
+           (index-vector (make-array (if capacity 0 length)
                                      :element-type
                                      '(unsigned-byte #.sb!vm:n-word-bits)
                                      :initial-element 0))
            ;; Needs to be the half the length of the KV vector to link
            ;; KV entries - mapped to indeces at 2i and 2i+1 -
            ;; together.
-           (next-vector (make-array size+1
+           (next-vector (make-array slots
                                     :element-type
-                                    '(unsigned-byte #.sb!vm:n-word-bits)))
-           (kv-vector (make-array (* 2 size+1)
+                                    '(unsigned-byte #.sb!vm:n-word-bits)
+                                    :initial-element 0))
+           (kv-vector (make-array (* 2 slots)
                                   :initial-element +empty-ht-slot+))
            (table (%make-hash-table
                    :test test
@@ -386,20 +419,27 @@ Examples:
                    :weakness weakness
                    :index-vector index-vector
                    :next-vector next-vector
+                   ;; EQ tables never compare hashes, but the GC looks
+                   ;; here to tell address-based keys from stably
+                   ;; hashed ones.
                    :hash-vector
-                   (unless (eq test 'eq)
-                     (make-array size+1
-                                 :element-type '(unsigned-byte
-                                                 #.sb!vm:n-word-bits)
-                                 :initial-element +magic-hash-vector-value+))
-                   :synchronized-p synchronized)))
-      (declare (type index size+1 scaled-size length))
-      ;; Set up the free list, all free. These lists are 0 terminated.
-      (do ((i 1 (1+ i)))
-          ((>= i size))
-        (setf (aref next-vector i) (1+ i)))
-      (setf (aref next-vector size) 0)
-      (setf (hash-table-next-free-kv table) 1)
+                   (make-array slots
+                               :element-type '(unsigned-byte
+                                               #.sb!vm:n-word-bits)
+                               :initial-element +magic-hash-vector-value+)
+                   :synchronized-p synchronized
+                   :open-addressing-p (and open-addressing t))))
+      (declare (type index size+1 scaled-size length slots))
+      (cond (capacity
+             (setf (hash-table-next-free-kv table) size))
+            (t
+             ;; Set up the free list, all free. These lists are 0
+             ;; terminated.
+             (do ((i 1 (1+ i)))
+                 ((>= i size))
+               (setf (aref next-vector i) (1+ i)))
+             (setf (aref next-vector size) 0)
+             (setf (hash-table-next-free-kv table) 1)))
       (setf (aref kv-vector 0) table)
       table)))
 
@@ -452,6 +492,8 @@ multiple threads accessing the same hash-table without locking."
 (defun rehash (table)
   (declare (type hash-table table))
   (aver *gc-inhibit*)
+  (when (hash-table-open-addressing-p table)
+    (return-from rehash (grow-open-addressing-table table)))
   (let* ((old-kv-vector (hash-table-table table))
          (old-next-vector (hash-table-next-vector table))
          (old-hash-vector (hash-table-hash-vector table))
@@ -560,6 +602,9 @@ multiple threads accessing the same hash-table without locking."
 (defun rehash-without-growing (table)
   (declare (type hash-table table))
   (aver *gc-inhibit*)
+  (when (hash-table-open-addressing-p table)
+    (return-from rehash-without-growing
+      (rebuild-open-addressing-table table (hash-table-rehash-trigger table))))
   (let* ((kv-vector (hash-table-table table))
          (next-vector (hash-table-next-vector table))
          (hash-vector (hash-table-hash-vector table))
@@ -649,6 +694,190 @@ multiple threads accessing the same hash-table without locking."
   (unless (hash-table-weakness hash-table)
     (setf (hash-table-cache hash-table) index)))
 
+;;;; open addressing
+;;;;
+;;;; An open-addressing table keeps each entry in the KV vector slot
+;;;; where a linear probe from its hash first found room, with the hash
+;;;; in the parallel hash vector, so a lookup usually reads one line of
+;;;; each. The next vector marks the slots which have ever been used
+;;;; since the table was last rebuilt: a probe stops at a slot which
+;;;; never has, and steps over one whose entry was removed. Removed
+;;;; slots are only reclaimed when the table is rebuilt, on growth or
+;;;; after the GC moves an address-based key.
+
+(defun open-addressing-capacity (size rehash-threshold)
+  (declare (type index size)
+           (type (single-float (0.0) 1.0) rehash-threshold))
+  (power-of-two-ceiling
+   (max (1+ +min-hash-table-size+)
+        (truncate (/ (float (1+ size)) (* 0.75 rehash-threshold))))))
+
+;;; Return the slot of KV-VECTOR, the table of HASH-TABLE, holding
+;;; KEY, or 0 if there is none, and the first slot on KEY's probe
+;;; sequence where it could be added. Callers pass in the KV-VECTOR
+;;; they go on to use, so that both refer to the same one even if
+;;; the table is rebuilt in between.
+(declaim (inline open-addressing-find))
+(defun open-addressing-find (hash-table kv-vector key hashing eq-based)
+  (declare (type hash hashing)
+           (type simple-vector kv-vector))
+  (let* ((next-vector (hash-table-next-vector hash-table))
+         (hash-vector (hash-table-hash-vector hash-table))
+         (test-fun (hash-table-test-fun hash-table))
+         (eq-test (or eq-based (eq (hash-table-test hash-table) 'eq)))
+         (capacity (1- (length next-vector)))
+         (mask (1- capacity))
+         (free 0))
+    (declare (type index capacity mask)
+             (type index/2 free))
+    (do ((probe (index-for-hashing hashing capacity)
+                (logand (1+ probe) mask))
+         (i 0 (1+ i)))
+        ((>= i capacity) (values 0 free))
+      (declare (type index probe i))
+      (let* ((slot (1+ probe))
+             (key-in-slot (aref kv-vector (* 2 slot))))
+        (cond ((eq key-in-slot +empty-ht-slot+)
+               (when (zerop free)
+                 (setf free slot))
+               (when (zerop (aref next-vector slot))
+                 (return (values 0 free))))
+              ((if eq-test
+                   (eq key key-in-slot)
+                   (and (= hashing (aref hash-vector slot))
+                        (funcall test-fun key key-in-slot)))
+               (return (values slot free))))))))
+
+(defun open-addressing-puthash (hash-table key value hashing eq-based)
+  (declare (type hash hashing)
+           (optimize speed))
+  (let ((kv-vector (hash-table-table hash-table)))
+    (multiple-value-bind (slot free)
+        (open-addressing-find hash-table kv-vector key hashing eq-based)
+      (declare (type index/2 slot free))
+      (cond ((plusp slot)
+             ;; Found, just replace the value.
+             (update-hash-table-cache hash-table (* 2 slot))
+             (setf (aref kv-vector (1+ (* 2 slot))) value))
+            (t
+             ;; MAYBE-REHASH left a never-used slot to stop the probe.
+             (aver (plusp free))
+             (let ((next-vector (hash-table-next-vector hash-table)))
+               (when (zerop (aref next-vector free))
+                 (decf (hash-table-next-free-kv hash-table))
+                 (setf (aref next-vector free) 1)))
+             (when eq-based
+               (set-header-data kv-vector
+                                sb!vm:vector-valid-hashing-subtype))
+             (setf (aref (hash-table-hash-vector hash-table) free)
+                   (if eq-based +magic-hash-vector-value+ hashing))
+             (setf (aref kv-vector (* 2 free)) key)
+             (setf (aref kv-vector (1+ (* 2 free))) value)
+             (incf (hash-table-number-entries hash-table))
+             (update-hash-table-cache hash-table (* 2 free))))))
+  value)
+
+(defun open-addressing-remhash (hash-table key hashing eq-based)
+  (declare (type hash hashing)
+           (optimize speed))
+  (let* ((kv-vector (hash-table-table hash-table))
+         (slot (open-addressing-find hash-table kv-vector key
+                                     hashing eq-based)))
+    (declare (type index/2 slot))
+    (unless (zerop slot)
+      ;; Leave the slot marked as used, so that probes for the keys
+      ;; after it still get past.
+      (setf (aref kv-vector (* 2 slot)) +empty-ht-slot+
+            (aref kv-vector (1+ (* 2 slot))) +empty-ht-slot+)
+      (setf (aref (hash-table-hash-vector hash-table) slot)
+            +magic-hash-vector-value+)
+      (decf (hash-table-number-entries hash-table))
+      t)))
+
+;;; Move the entries of TABLE into fresh vectors with room for SIZE
+;;; of them, dropping the slots of removed entries.
+(defun rebuild-open-addressing-table (table size)
+  (declare (type hash-table table)
+           (type index size))
+  (aver *gc-inhibit*)
+  (let* ((old-kv-vector (hash-table-table table))
+         (old-hash-vector (hash-table-hash-vector table))
+         (old-slots (length (hash-table-next-vector table)))
+         (capacity (open-addressing-capacity
+                    size (hash-table-rehash-threshold table)))
+         (mask (1- capacity))
+         (kv-vector (make-array (* 2 (1+ capacity))
+                                :initial-element +empty-ht-slot+))
+         (next-vector (make-array (1+ capacity)
+                                  :element-type
+                                  '(unsigned-byte #.sb!vm:n-word-bits)
+                                  :initial-element 0))
+         (hash-vector (make-array (1+ capacity)
+                                  :element-type
+                                  '(unsigned-byte #.sb!vm:n-word-bits)
+                                  :initial-element +magic-hash-vector-value+))
+         (count 0))
+    (declare (type index old-slots capacity mask count))
+    (setf (aref kv-vector 0) table)
+    ;; Disable GC tricks on the OLD-KV-VECTOR.
+    (set-header-data old-kv-vector sb!vm:vector-normal-subtype)
+    ;; Non-empty weak hash tables always need GC support.
+    (when (and (hash-table-weakness table) (plusp (hash-table-count table)))
+      (set-header-data kv-vector sb!vm:vector-valid-hashing-subtype))
+    (do ((i 1 (1+ i)))
+        ((>= i old-slots))
+      (declare (type index/2 i))
+      (let ((key (aref old-kv-vector (* 2 i))))
+        (unless (eq key +empty-ht-slot+)
+          (let* ((hashing (aref old-hash-vector i))
+                 (probe (index-for-hashing
+                         (if (= hashing +magic-hash-vector-value+)
+                             (progn
+                               ;; EQ based hash. Enable GC tricks.
+                               (set-header-data
+                                kv-vector sb!vm:vector-valid-hashing-subtype)
+                               (pointer-hash key))
+                             hashing)
+                         capacity)))
+            (declare (type index probe))
+            (loop until (zerop (aref next-vector (1+ probe)))
+                  do (setf probe (logand (1+ probe) mask)))
+            (let ((slot (1+ probe)))
+              (setf (aref next-vector slot) 1
+                    (aref hash-vector slot) hashing
+                    (aref kv-vector (* 2 slot)) key
+                    (aref kv-vector (1+ (* 2 slot)))
+                    (aref old-kv-vector (1+ (* 2 i))))
+              (incf count))))))
+    (aver (<= count size))
+    (setf (hash-table-table table) kv-vector)
+    (setf (hash-table-next-vector table) next-vector)
+    (setf (hash-table-hash-vector table) hash-vector)
+    (setf (hash-table-rehash-trigger table) size)
+    (setf (hash-table-next-free-kv table) (- size count))
+    (setf (hash-table-cache table) nil)
+    ;; Fill the old kv-vector with 0 to help the conservative GC.
+    (fill old-kv-vector 0)
+    (setf (hash-table-needs-rehash-p table) nil))
+  (values))
+
+;;; Called when every never-used slot has been claimed. If removals
+;;; account for many of them, rebuilding at the same size is enough.
+(defun grow-open-addressing-table (table)
+  (declare (type hash-table table))
+  (let ((size (hash-table-rehash-trigger table)))
+    (rebuild-open-addressing-table
+     table
+     (if (<= (hash-table-count table) (floor size 2))
+         size
+         (max (1+ size)
+              (let ((rehash-size (hash-table-rehash-size table)))
+                (etypecase rehash-size
+                  (fixnum
+                   (+ rehash-size size))
+                  (float
+                   (the index (truncate (* rehash-size size))))))))))))
+
 (defmacro with-hash-table-locks ((hash-table
                                   &key (operation :write) inline pin
                                   (synchronized `(hash-table-synchronized-p ,hash-table)))
@@ -723,6 +952,15 @@ if there is no such entry. Entries can be added using SETF."
                (multiple-value-bind (hashing eq-based)
                    (funcall (hash-table-hash-fun hash-table) key)
                  (declare (type hash hashing))
+                 (when (hash-table-open-addressing-p hash-table)
+                   (let ((slot (open-addressing-find hash-table table key
+                                                     hashing eq-based)))
+                     (declare (type index/2 slot))
+                     (when (zerop slot)
+                       (result default nil))
+                     (update-hash-table-cache hash-table (* 2 slot))
+                     (let ((value (aref table (1+ (* 2 slot)))))
+                       (result value t))))
                  (let* ((index-vector (hash-table-index-vector hash-table))
                         (length (length index-vector))
                         (index (index-for-hashing hashing length))
@@ -732,7 +970,7 @@ if there is no such entry. Entries can be added using SETF."
                         (test-fun (hash-table-test-fun hash-table)))
                    (declare (type index index))
                    ;; Search next-vector chain for a matching key.
-                   (if (or eq-based (not hash-vector))
+                   (if (or eq-based (eq (hash-table-test hash-table) 'eq))
                        (do ((next next (aref next-vector next))
                             (i 0 (1+ i)))
                            ((zerop next) (result default nil))
@@ -780,6 +1018,12 @@ if there is no such entry. Entries can be added using SETF."
   (multiple-value-bind (hashing eq-based)
       (funcall (hash-table-hash-fun hash-table) key)
     (declare (type hash hashing))
+    (when (hash-table-weakness hash-table)
+      (set-header-data (hash-table-table hash-table)
+                       sb!vm:vector-valid-hashing-subtype))
+    (when (hash-table-open-addressing-p hash-table)
+      (return-from %%puthash
+        (open-addressing-puthash hash-table key value hashing eq-based)))
     (let* ((index-vector (hash-table-index-vector hash-table))
            (length (length index-vector))
            (index (index-for-hashing hashing length))
@@ -789,9 +1033,7 @@ if there is no such entry. Entries can be added using SETF."
            (hash-vector (hash-table-hash-vector hash-table))
            (test-fun (hash-table-test-fun hash-table)))
       (declare (type index index next))
-      (when (hash-table-weakness hash-table)
-        (set-header-data kv-vector sb!vm:vector-valid-hashing-subtype))
-      (cond ((or eq-based (not hash-vector))
+      (cond ((or eq-based (eq (hash-table-test hash-table) 'eq))
              (when eq-based
                (set-header-data kv-vector
                                 sb!vm:vector-valid-hashing-subtype))
@@ -883,6 +1125,9 @@ if there is no such entry. Entries can be added using SETF."
   (multiple-value-bind (hashing eq-based)
       (funcall (hash-table-hash-fun hash-table) key)
     (declare (type hash hashing))
+    (when (hash-table-open-addressing-p hash-table)
+      (return-from %remhash
+        (open-addressing-remhash hash-table key hashing eq-based)))
     (let* ((index-vector (hash-table-index-vector hash-table))
            (length (length index-vector))
            (index (index-for-hashing hashing length))
@@ -914,13 +1159,13 @@ if there is no such entry. Entries can be added using SETF."
                t))
         (cond ((zerop next)
                nil)
-              ((if (or eq-based (not hash-vector))
+              ((if (or eq-based (eq (hash-table-test hash-table) 'eq))
                    (eq key (aref table (* 2 next)))
                    (and (= hashing (aref hash-vector next))
                         (funcall test-fun key (aref table (* 2 next)))))
                (clear-slot index-vector index next))
               ;; Search next-vector chain for a matching key.
-              ((or eq-based (not hash-vector))
+              ((or eq-based (eq (hash-table-test hash-table) 'eq))
                ;; EQ based
                (do ((prior next next)
                     (i 0 (1+ i))
@@ -973,12 +1218,18 @@ table itself."
         ;; tag.
         (aver (eq (aref kv-vector 0) hash-table))
         (fill kv-vector +empty-ht-slot+ :start 2)
-        ;; Set up the free list, all free.
-        (do ((i 1 (1+ i)))
-            ((>= i (1- size)))
-          (setf (aref next-vector i) (1+ i)))
-        (setf (aref next-vector (1- size)) 0)
-        (setf (hash-table-next-free-kv hash-table) 1)
+        (cond ((hash-table-open-addressing-p hash-table)
+               ;; Every slot is never-used again.
+               (fill next-vector 0)
+               (setf (hash-table-next-free-kv hash-table)
+                     (hash-table-rehash-trigger hash-table)))
+              (t
+               ;; Set up the free list, all free.
+               (do ((i 1 (1+ i)))
+                   ((>= i (1- size)))
+                 (setf (aref next-vector i) (1+ i)))
+               (setf (aref next-vector (1- size)) 0)
+               (setf (hash-table-next-free-kv hash-table) 1)))
         ;; Clear the index-vector.
         (fill index-vector 0)
         ;; Clear the hash-vector.
@@ -1037,7 +1288,9 @@ to protect the MAPHASH call."
     :size             ',(hash-table-size             hash-table)
     :rehash-size      ',(hash-table-rehash-size      hash-table)
     :rehash-threshold ',(hash-table-rehash-threshold hash-table)
-    :weakness         ',(hash-table-weakness         hash-table)))
+    :weakness         ',(hash-table-weakness         hash-table)
+    ,@(when (hash-table-open-addressing-p hash-table)
+        '(:open-addressing t))))
 
 ;;; Return an association list representing the same data as HASH-TABLE.
 (defun %hash-table-alist (hash-table)
@@ -211,7 +211,8 @@
         (read-n-bytes *fasl-input-stream*
                       (code-instructions code)
                       0
-                      code-length))
+                      code-length)
+        (sb!c::note-code-for-perf-map code))
       code)))
 
 ;;; Moving native code during a GC or purify is not so trivial on the
@@ -261,7 +262,8 @@
            (read-n-bytes *fasl-input-stream*
                          (code-instructions code)
                          0
-                         code-length))
+                         code-length)
+           (sb!c::note-code-for-perf-map code))
           code)))))
 
 ;;;; linkage fixups
@@ -253,6 +253,18 @@ created and old ones may exit at any time."
   #!-sb-thread
   0)
 
+#!+(and sb-thread sb-futex)
+(progn
+  ;; Bounds on how many times a thread polls a held mutex before it
+  ;; goes to sleep on it. Between them, it polls for about twice as
+  ;; long as spinning recently took to get the mutex.
+  (defconstant +mutex-min-spins+ 10)
+  (defconstant +mutex-max-spins+ 1000)
+
+  ;; Spinning only pays if the owner can run meanwhile, so it's off on
+  ;; a single processor. Set by INIT-INITIAL-THREAD.
+  (sb!ext:defglobal **mutex-spin-p** nil))
+
 (defvar *initial-thread* nil)
 (defvar *make-thread-lock*)
 
@@ -265,6 +277,8 @@ created and old ones may exit at any time."
                                       :os-thread (current-thread-os-thread))))
     (setq *initial-thread* initial-thread
           *current-thread* initial-thread)
+    #!+(and sb-thread sb-futex)
+    (setq **mutex-spin-p** (> (%online-processor-count) 1))
     (grab-mutex (thread-result-lock *initial-thread*))
     ;; Either *all-threads* is empty or it contains exactly one thread
     ;; in case we are in reinit since saving core with multiple
@@ -374,6 +388,9 @@ See also: RETURN-FROM-THREAD and SB-EXT:EXIT."
       (with-interrupts
         (%futex-wait word old to-sec to-usec)))
 
+    (define-alien-routine ("online_processor_count" %online-processor-count)
+        int)
+
     (define-alien-routine "futex_wake"
         int (word unsigned) (n unsigned-long))))
 
@@ -434,7 +451,50 @@ See also: RETURN-FROM-THREAD and SB-EXT:EXIT."
   ;; lisp objects that don't need pinning.
   (defconstant +lock-free+ 0)
   (defconstant +lock-taken+ 1)
-  (defconstant +lock-contested+ 2))
+  (defconstant +lock-contested+ 2)
+
+  (declaim (inline mutex-spin-budget))
+  (defun mutex-spin-budget (mutex)
+    (min +mutex-max-spins+
+         (+ +mutex-min-spins+ (* 2 (mutex-%spins mutex)))))
+
+  ;; Called by the thread which has just acquired MUTEX after SPUN
+  ;; polls and PARKS sleeps on it. Spinning which ended in sleep makes
+  ;; the next spin shorter.
+  (declaim (inline note-mutex-contention))
+  (defun note-mutex-contention (mutex spun parks)
+    (declare (type fixnum spun parks))
+    (let ((spins (mutex-%spins mutex)))
+      (setf (mutex-%spins mutex)
+            (if (zerop parks)
+                (+ spins (truncate (- spun spins) 8))
+                (- spins (ceiling spins 4)))))
+    ;; The counts stick at MOST-POSITIVE-FIXNUM rather than overflow,
+    ;; which a busy mutex can reach on 32-bit platforms.
+    (macrolet ((count-up (place &optional (delta 1))
+                 `(setf ,place (min most-positive-fixnum (+ ,place ,delta)))))
+      (count-up (mutex-%contentions mutex))
+      (when (and (plusp spun) (zerop parks))
+        (count-up (mutex-%spin-acquisitions mutex)))
+      (count-up (mutex-%parks mutex) parks))))
+
+(defun mutex-statistics (mutex)
+  #!+sb-doc
+  "Return a property list describing how MUTEX has been contended:
+:CONTENTIONS is the number of times a thread had to wait for it,
+:SPIN-ACQUISITIONS how many of those waits ended while the thread was still
+spinning, :PARKS the number of times a waiting thread went to sleep, and
+:SPIN-ESTIMATE the current average spin length used to size the next spin.
+The counts are only approximate while other threads use MUTEX. Returns NIL
+on platforms where mutexes don't spin."
+  (declare (type mutex mutex) (ignorable mutex))
+  #!+(and sb-thread sb-futex)
+  (list :contentions (mutex-%contentions mutex)
+        :spin-acquisitions (mutex-%spin-acquisitions mutex)
+        :parks (mutex-%parks mutex)
+        :spin-estimate (mutex-%spins mutex))
+  #!-(and sb-thread sb-futex)
+  nil)
 
 (defun mutex-owner (mutex)
   "Current owner of the mutex, NIL if the mutex is free. Naturally,
@@ -560,43 +620,67 @@ HOLDING-MUTEX-P."
     (sb!impl::%%wait-for #'cas stop-sec stop-usec))
   #!+sb-futex
   ;; This is a fairly direct translation of the Mutex 2 algorithm from
-  ;; "Futexes are Tricky" by Ulrich Drepper.
-  (flet ((maybe (old)
-           (when (eql +lock-free+ old)
-             (let ((prev (sb!ext:compare-and-swap (mutex-%owner mutex)
-                                                  nil new-owner)))
-               (when prev
-                 (bug "Old owner in free mutex: ~S" prev))
-               (return-from %%wait-for-mutex t)))))
-    (prog ((old (sb!ext:compare-and-swap (mutex-state mutex)
-                                         +lock-free+ +lock-taken+)))
-       ;; Got it right off the bat?
-       (maybe old)
-     :retry
-       ;; Mark it as contested, and sleep. (Exception: it was just released.)
-       (when (or (eql +lock-contested+ old)
-                 (not (eql +lock-free+
-                           (sb!ext:compare-and-swap
-                            (mutex-state mutex) +lock-taken+ +lock-contested+))))
-         (when (eql 1 (with-pinned-objects (mutex)
-                        (futex-wait (mutex-state-address mutex)
-                                    (get-lisp-obj-address +lock-contested+)
-                                    (or to-sec -1)
-                                    (or to-usec 0))))
-           ;; -1 = EWOULDBLOCK, possibly spurious wakeup
-           ;;  0 = normal wakeup
-           ;;  1 = ETIMEDOUT ***DONE***
-           ;;  2 = EINTR, a spurious wakeup
-           (return-from %%wait-for-mutex nil)))
-       ;; Try to get it, still marking it as contested.
-       (maybe
-        (sb!ext:compare-and-swap (mutex-state mutex) +lock-free+ +lock-contested+))
-       ;; Update timeout if necessary.
-       (when stop-sec
-         (setf (values to-sec to-usec)
-               (sb!impl::relative-decoded-times stop-sec stop-usec)))
-       ;; Spin.
-       (go :retry))))
+  ;; "Futexes are Tricky" by Ulrich Drepper, with a bounded spin before
+  ;; the first sleep.
+  (let ((spun 0)
+        (parks 0))
+    (declare (type fixnum spun parks))
+    (flet ((maybe (old)
+             (when (eql +lock-free+ old)
+               (let ((prev (sb!ext:compare-and-swap (mutex-%owner mutex)
+                                                    nil new-owner)))
+                 (when prev
+                   (bug "Old owner in free mutex: ~S" prev))
+                 (note-mutex-contention mutex spun parks)
+                 (return-from %%wait-for-mutex t)))))
+      (prog ((old (sb!ext:compare-and-swap (mutex-state mutex)
+                                           +lock-free+ +lock-taken+)))
+         ;; Got it right off the bat?
+         (maybe old)
+         ;; Poll for a while before sleeping, unless somebody is already
+         ;; asleep on it: then it's held for long, or handed over in
+         ;; turn, and the futex queue is the fairer place to wait.
+         (when (and **mutex-spin-p** (eql +lock-taken+ old))
+           (let ((budget (mutex-spin-budget mutex)))
+             (loop while (< spun budget)
+                   do (incf spun)
+                      (sb!ext:spin-loop-hint)
+                      (barrier (:read))
+                      (let ((state (mutex-state mutex)))
+                        (cond ((eql +lock-free+ state)
+                               (setf old (sb!ext:compare-and-swap
+                                          (mutex-state mutex)
+                                          +lock-free+ +lock-taken+))
+                               (maybe old))
+                              ((eql +lock-contested+ state)
+                               (setf old state)
+                               (return)))))))
+       :retry
+         ;; Mark it as contested, and sleep. (Exception: it was just released.)
+         (when (or (eql +lock-contested+ old)
+                   (not (eql +lock-free+
+                             (sb!ext:compare-and-swap
+                              (mutex-state mutex) +lock-taken+ +lock-contested+))))
+           (incf parks)
+           (when (eql 1 (with-pinned-objects (mutex)
+                          (futex-wait (mutex-state-address mutex)
+                                      (get-lisp-obj-address +lock-contested+)
+                                      (or to-sec -1)
+                                      (or to-usec 0))))
+             ;; -1 = EWOULDBLOCK, possibly spurious wakeup
+             ;;  0 = normal wakeup
+             ;;  1 = ETIMEDOUT ***DONE***
+             ;;  2 = EINTR, a spurious wakeup
+             (return-from %%wait-for-mutex nil)))
+         ;; Try to get it, still marking it as contested.
+         (maybe
+          (sb!ext:compare-and-swap (mutex-state mutex) +lock-free+ +lock-contested+))
+         ;; Update timeout if necessary.
+         (when stop-sec
+           (setf (values to-sec to-usec)
+                 (sb!impl::relative-decoded-times stop-sec stop-usec)))
+         ;; Spin.
+         (go :retry)))))
 
 #!+sb-thread
 (defun %wait-for-mutex (mutex self timeout to-sec to-usec stop-sec stop-usec deadlinep)
@@ -1128,6 +1212,248 @@ on this semaphore, then N of them is woken up."
         (condition-notify (semaphore-queue semaphore) (min waitcount count))))))
 
 
+;;;; Reader-writer locks
+
+#!+(and sb-thread sb-futex)
+(progn
+  ;; Readers count themselves in one of several stripes, each on a
+  ;; cache line of its own, so that readers on different processors
+  ;; don't contend for one counter. A writer sums the stripes.
+  (defconstant +rwlock-stripes+ 16)
+  (defconstant +rwlock-stripe-words+ (/ 64 sb!vm:n-word-bytes)))
+
+;;; Threads take their reader count stripe from this, round-robin.
+(sb!ext:defglobal **next-thread-stripe** 0)
+(declaim (type fixnum **next-thread-stripe**))
+
+(defstruct (rwlock (:constructor %make-rwlock (name))
+                   (:copier nil))
+  #!+sb-doc
+  "Reader-writer lock type. The fact that a RWLOCK is a STRUCTURE-OBJECT
+should be considered an implementation detail, and may change in the
+future."
+  (name nil :type (or null thread-name))
+  ;; With futexes, serializes writers. Otherwise, protects the counts
+  ;; below.
+  (mutex (make-mutex :name "rwlock mutex") :type mutex :read-only t)
+  ;; Reader counts, one per stripe.
+  #!+(and sb-thread sb-futex)
+  (readers (make-array (* +rwlock-stripes+ +rwlock-stripe-words+)
+                       :element-type 'sb!vm:word
+                       :initial-element 0)
+   :type (simple-array sb!vm:word (*))
+   :read-only t)
+  ;; Twice the number of writers holding or waiting for the lock, plus
+  ;; one if readers are asleep waiting for them. Readers sleep on it.
+  #!+(and sb-thread sb-futex)
+  (writers 0 :type fixnum)
+  ;; Changed by every reader that leaves while a writer is waiting.
+  ;; The writer waiting for the readers to leave sleeps on it.
+  #!+(and sb-thread sb-futex)
+  (drain 0 :type fixnum)
+  ;; Number of readers holding the lock, or -1 if a writer holds it,
+  ;; and the number of writers holding or waiting for it.
+  #!-(and sb-thread sb-futex)
+  (readers 0 :type fixnum)
+  #!-(and sb-thread sb-futex)
+  (writers 0 :type fixnum)
+  #!-(and sb-thread sb-futex)
+  (queue (make-waitqueue :name "rwlock queue") :read-only t))
+
+#!+sb-doc
+(setf (fdocumentation 'rwlock-name 'function)
+      "The name of the reader-writer lock. Setfable.")
+
+(defun make-rwlock (&key name)
+  #!+sb-doc
+  "Create a reader-writer lock. See WITH-READ-LOCK and WITH-WRITE-LOCK."
+  (%make-rwlock name))
+
+#!+(and sb-thread sb-futex)
+(progn
+  (define-structure-slot-addressor rwlock-writers-address
+      :structure rwlock
+      :slot writers)
+  (define-structure-slot-addressor rwlock-drain-address
+      :structure rwlock
+      :slot drain)
+
+  (declaim (inline rwlock-stripe-index))
+  (defun rwlock-stripe-index ()
+    (* +rwlock-stripe-words+
+       (logand (1- +rwlock-stripes+) (thread-stripe *current-thread*))))
+
+  (defun rwlock-reader-count (rwlock)
+    (let ((readers (rwlock-readers rwlock))
+          (sum 0))
+      (declare (type sb!vm:word sum))
+      (loop for index from 0 below (length readers) by +rwlock-stripe-words+
+            do (setf sum (logand (+ sum (aref readers index))
+                                 most-positive-word)))
+      sum))
+
+  ;; Called by a reader which has just decremented its stripe: if a
+  ;; writer is waiting for the readers to leave, let it recount them.
+  (defun rwlock-reader-left (rwlock)
+    (barrier (:memory))
+    (unless (zerop (rwlock-writers rwlock))
+      (loop for old = (rwlock-drain rwlock)
+            until (eql old (sb!ext:compare-and-swap
+                            (rwlock-drain rwlock)
+                            old (logand (1+ old) most-positive-fixnum))))
+      (with-pinned-objects (rwlock)
+        (futex-wake (rwlock-drain-address rwlock) 1))))
+
+  (defun %grab-read-lock (rwlock)
+    (let ((readers (rwlock-readers rwlock))
+          (index (rwlock-stripe-index)))
+      (loop
+        (barrier (:read))
+        (when (zerop (rwlock-writers rwlock))
+          (sb!ext:atomic-incf (aref readers index))
+          (barrier (:memory))
+          ;; Pairs with the writer announcing itself before counting
+          ;; the readers: either it sees us, or we see it.
+          (when (zerop (rwlock-writers rwlock))
+            (return t))
+          (sb!ext:atomic-decf (aref readers index))
+          (rwlock-reader-left rwlock))
+        ;; Writers come first. Note that a reader is asleep, then sleep
+        ;; until the writers change. (Exception: they just left.)
+        (let ((writers (rwlock-writers rwlock)))
+          (when (and (not (zerop writers))
+                     (or (oddp writers)
+                         (eql writers (sb!ext:compare-and-swap
+                                       (rwlock-writers rwlock)
+                                       writers (logior writers 1)))))
+            (with-pinned-objects (rwlock)
+              (futex-wait (rwlock-writers-address rwlock)
+                          (get-lisp-obj-address (logior writers 1))
+                          -1 0)))))))
+
+  (defun %release-read-lock (rwlock)
+    (sb!ext:atomic-decf (aref (rwlock-readers rwlock) (rwlock-stripe-index)))
+    (rwlock-reader-left rwlock))
+
+  ;; Undo a writer's announcement. The last writer to leave wakes the
+  ;; readers that went to sleep waiting for the writers.
+  (defun rwlock-writer-left (rwlock)
+    (loop for old = (rwlock-writers rwlock)
+          for new = (if (< old 4) 0 (- old 2))
+          when (eql old (sb!ext:compare-and-swap (rwlock-writers rwlock)
+                                                 old new))
+            do (when (and (oddp old) (zerop new))
+                 (with-pinned-objects (rwlock)
+                   (futex-wake (rwlock-writers-address rwlock)
+                               (ldb (byte 29 0) most-positive-fixnum))))
+               (return)))
+
+  (defun %grab-write-lock (rwlock)
+    (let ((mutex (rwlock-mutex rwlock))
+          (got-mutex nil)
+          (done nil))
+      (unwind-protect
+           (progn
+             ;; Announce ourselves first, so that no new readers come
+             ;; in while we wait for other writers.
+             (loop for old = (rwlock-writers rwlock)
+                   until (eql old (sb!ext:compare-and-swap
+                                   (rwlock-writers rwlock) old (+ old 2))))
+             (setf got-mutex (grab-mutex mutex))
+             ;; Wait for the readers to leave. Reading the drain token
+             ;; before counting means a reader leaving after the count
+             ;; changes it, and FUTEX-WAIT returns at once.
+             (loop
+               (let ((token (rwlock-drain rwlock)))
+                 (barrier (:memory))
+                 (when (zerop (rwlock-reader-count rwlock))
+                   (return))
+                 (with-pinned-objects (rwlock)
+                   (futex-wait (rwlock-drain-address rwlock)
+                               (get-lisp-obj-address token)
+                               -1 0))))
+             (setf done t))
+        (unless done
+          (when got-mutex
+            (release-mutex mutex))
+          (rwlock-writer-left rwlock))))
+    t)
+
+  (defun %release-write-lock (rwlock)
+    (release-mutex (rwlock-mutex rwlock))
+    (rwlock-writer-left rwlock)))
+
+#!+(and sb-thread (not sb-futex))
+(progn
+  (defun %grab-read-lock (rwlock)
+    (with-system-mutex ((rwlock-mutex rwlock) :allow-with-interrupts t)
+      (loop while (or (minusp (rwlock-readers rwlock))
+                      (plusp (rwlock-writers rwlock)))
+            do (condition-wait (rwlock-queue rwlock) (rwlock-mutex rwlock)))
+      (incf (rwlock-readers rwlock)))
+    t)
+
+  (defun %release-read-lock (rwlock)
+    (with-system-mutex ((rwlock-mutex rwlock))
+      (when (and (zerop (decf (rwlock-readers rwlock)))
+                 (plusp (rwlock-writers rwlock)))
+        (condition-broadcast (rwlock-queue rwlock)))))
+
+  (defun %grab-write-lock (rwlock)
+    (with-system-mutex ((rwlock-mutex rwlock) :allow-with-interrupts t)
+      (let ((done nil))
+        (incf (rwlock-writers rwlock))
+        (unwind-protect
+             (progn
+               (loop until (zerop (rwlock-readers rwlock))
+                     do (condition-wait (rwlock-queue rwlock)
+                                        (rwlock-mutex rwlock)))
+               (setf (rwlock-readers rwlock) -1
+                     done t))
+          (decf (rwlock-writers rwlock))
+          (unless done
+            (condition-broadcast (rwlock-queue rwlock))))))
+    t)
+
+  (defun %release-write-lock (rwlock)
+    (with-system-mutex ((rwlock-mutex rwlock))
+      (setf (rwlock-readers rwlock) 0)
+      (condition-broadcast (rwlock-queue rwlock)))))
+
+#!-sb-thread
+(progn
+  (defun call-with-read-lock (function rwlock)
+    (declare (function function) (ignore rwlock))
+    (funcall function))
+
+  (defun call-with-write-lock (function rwlock)
+    (declare (function function) (ignore rwlock))
+    (funcall function)))
+
+#!+sb-thread
+(progn
+  (defun call-with-read-lock (function rwlock)
+    (declare (function function))
+    (dx-let ((got-it nil))
+      (without-interrupts
+        (unwind-protect
+             (when (setq got-it (allow-with-interrupts
+                                  (%grab-read-lock rwlock)))
+               (with-local-interrupts (funcall function)))
+          (when got-it
+            (%release-read-lock rwlock))))))
+
+  (defun call-with-write-lock (function rwlock)
+    (declare (function function))
+    (dx-let ((got-it nil))
+      (without-interrupts
+        (unwind-protect
+             (when (setq got-it (allow-with-interrupts
+                                  (%grab-write-lock rwlock)))
+               (with-local-interrupts (funcall function)))
+          (when got-it
+            (%release-write-lock rwlock)))))))
+
 ;;;; Job control, independent listeners
 
 (defstruct session
@@ -1358,7 +1684,10 @@ See also: RETURN-FROM-THREAD, ABORT-THREAD."
                        'make-thread arguments)
   #!+sb-thread
      (with-mutex (*make-thread-lock*)
-       (let* ((thread (%make-thread :name name :%ephemeral-p ephemeral))
+       (let* ((thread (%make-thread :name name :%ephemeral-p ephemeral
+                                    :stripe (setf **next-thread-stripe**
+                                                  (logand (1+ **next-thread-stripe**)
+                                                          most-positive-fixnum))))
               (setup-sem (make-semaphore :name "Thread setup semaphore"))
               (real-function (coerce function 'function))
               (arguments     (if (listp arguments)
@@ -33,6 +33,9 @@ in future versions."
   (result-lock
    (make-mutex :name "thread result lock")
    :type mutex)
+  ;; Which stripe of a reader-writer lock's reader counts this thread
+  ;; uses, assigned round-robin by MAKE-THREAD.
+  (stripe        0 :type fixnum)
   waiting-for)
 
 (def!struct mutex
@@ -41,7 +44,19 @@ in future versions."
   (name   nil :type (or null thread-name))
   (%owner nil :type (or null thread))
   #!+(and sb-thread sb-futex)
-  (state    0 :type fixnum))
+  (state    0 :type fixnum)
+  ;; Running average of how long contending threads spun before
+  ;; getting the mutex, which sizes the next spin, and counts of how
+  ;; it was contended. Only the thread which has just acquired the
+  ;; mutex updates these.
+  #!+(and sb-thread sb-futex)
+  (%spins             0 :type fixnum)
+  #!+(and sb-thread sb-futex)
+  (%contentions       0 :type fixnum)
+  #!+(and sb-thread sb-futex)
+  (%spin-acquisitions 0 :type fixnum)
+  #!+(and sb-thread sb-futex)
+  (%parks             0 :type fixnum))
 
 (defun mutex-value (mutex)
   "Current owner of the mutex, NIL if the mutex is free. May return a
@@ -194,6 +209,28 @@ held mutex, WITH-RECURSIVE-LOCK allows recursive lock attempts to succeed."
       ,wait-p
       ,timeout)))
 
+(sb!xc:defmacro with-read-lock ((rwlock) &body body)
+  #!+sb-doc
+  "Acquire RWLOCK for reading for the dynamic scope of BODY, sleeping while
+a writer holds it or is waiting for it. Any number of threads can hold RWLOCK
+for reading at once. Returns the values of BODY.
+
+Read locks are not recursive: a thread already holding RWLOCK must not
+acquire it again, since a writer arriving in between would deadlock it."
+  `(dx-flet ((with-read-lock-thunk () ,@body))
+     (call-with-read-lock #'with-read-lock-thunk ,rwlock)))
+
+(sb!xc:defmacro with-write-lock ((rwlock) &body body)
+  #!+sb-doc
+  "Acquire RWLOCK for writing for the dynamic scope of BODY, sleeping until
+no other thread holds it. While a thread holds or waits for the write lock,
+new readers wait for it. Returns the values of BODY.
+
+Write locks are not recursive, and a thread holding RWLOCK for reading must
+not acquire it for writing."
+  `(dx-flet ((with-write-lock-thunk () ,@body))
+     (call-with-write-lock #'with-write-lock-thunk ,rwlock)))
+
 (sb!xc:defmacro with-recursive-system-lock ((lock
                                              &key without-gcing)
                                             &body body)
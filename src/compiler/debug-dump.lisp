@@ -589,6 +589,103 @@
         (setf (svref funs-vec (1+ i)) (cdr dfun))))
     funs-vec))
 
+;;;; stack maps
+
+;;; With safepoints, every thread is stopped either in foreign code or
+;;; at a safepoint, so the frames above it are all suspended at a call
+;;; site. The collector follows the frame pointer chain and looks up
+;;; the return address of each frame here, then scans the caller's
+;;; slots precisely instead of treating every word as a possible
+;;; pointer.
+;;;
+;;; The map is an (UNSIGNED-BYTE 32) vector holding the frame size in
+;;; words (shared by every frame of the component), the number W of
+;;; 32-bit words in a slot bitmap, and one entry per call site, in
+;;; increasing PC order: the PC of the return address relative to the
+;;; start of the instructions, W words with a bit for each slot
+;;; holding a live descriptor, and W words with a bit for each live
+;;; slot which must still be scanned conservatively. Slots in neither
+;;; set are dead or hold raw data.
+;;;
+;;; WITH-PINNED-OBJECTS only keeps its objects in place because the
+;;; stack is scanned conservatively, so components which use it get
+;;; no map at all.
+#!+(and x86-64 sb-gc-safepoint)
+(defun compute-stack-maps (component)
+  (declare (type component component))
+  (let* ((size (max 3 (sb-allocated-size 'stack)))
+         (nwords (ceiling size 32))
+         (entries nil))
+    (flet ((slot-location (tn)
+             (let ((tn (if (eq (sb-name (sc-sb (tn-sc tn))) 'stack)
+                           tn
+                           (tn-save-tn tn))))
+               (when (and tn (eq (sb-name (sc-sb (tn-sc tn))) 'stack))
+                 tn))))
+      (do-ir2-blocks (2block component)
+        (do ((vop (ir2-block-start-vop 2block) (vop-next vop)))
+            ((null vop))
+          (when (eq (vop-info-name (vop-info vop)) 'sb!vm::touch-object)
+            (return-from compute-stack-maps nil)))
+        (dolist (loc (ir2-block-locations 2block))
+          (let ((vop (location-info-vop loc))
+                (label (location-info-label loc)))
+            (when (and label
+                       (vop-save-set vop)
+                       (member (location-info-kind loc)
+                               '(:single-value-return :unknown-return
+                                 :known-return)))
+              (let ((precise (make-array size :element-type 'bit
+                                              :initial-element 0))
+                    (ambiguous (make-array size :element-type 'bit
+                                                :initial-element 0)))
+                (do-live-tns (tn (vop-save-set vop) (vop-block vop))
+                  (let ((slot (slot-location tn)))
+                    (when slot
+                      (let* ((sc (tn-sc slot))
+                             (offset (tn-offset slot))
+                             (end (min size (+ offset (sc-element-size sc)))))
+                        ;; Slots 0 and 1 are the old frame pointer and
+                        ;; the return address.
+                        (case (sc-name sc)
+                          (sb!vm::control-stack
+                           (when (< 1 offset size)
+                             (setf (sbit precise offset) 1)))
+                          ((sb!vm::signed-stack sb!vm::unsigned-stack
+                            sb!vm::character-stack sb!vm::sap-stack
+                            sb!vm::single-stack sb!vm::double-stack
+                            sb!vm::complex-single-stack
+                            sb!vm::complex-double-stack))
+                          (t
+                           (loop for i from (max offset 2) below end
+                                 do (setf (sbit ambiguous i) 1))))))))
+                (push (list (label-position label)
+                            (bit-andc2 precise ambiguous)
+                            ambiguous)
+                      entries)))))))
+    (when entries
+      (let* ((entries (remove-duplicates (sort entries #'< :key #'first)
+                                         :key #'first :from-end t))
+             (map (make-array (+ 2 (* (length entries) (1+ (* 2 nwords))))
+                              :element-type '(unsigned-byte 32)
+                              :initial-element 0))
+             (index 2))
+        (setf (aref map 0) size
+              (aref map 1) nwords)
+        (dolist (entry entries map)
+          (destructuring-bind (pc precise ambiguous) entry
+            (setf (aref map index) pc)
+            (dotimes (i size)
+              (unless (zerop (sbit precise i))
+                (setf (ldb (byte 1 (mod i 32))
+                           (aref map (+ index 1 (floor i 32))))
+                      1))
+              (unless (zerop (sbit ambiguous i))
+                (setf (ldb (byte 1 (mod i 32))
+                           (aref map (+ index 1 nwords (floor i 32))))
+                      1)))
+            (incf index (1+ (* 2 nwords)))))))))
+
 ;;; Return a DEBUG-INFO structure describing COMPONENT. This has to be
 ;;; called after assembly so that source map information is available.
 (defun debug-info-for-component (component)
@@ -607,7 +704,11 @@
     (let* ((sorted (sort dfuns #'< :key #'car))
            (fun-map (compute-debug-fun-map sorted)))
       (make-compiled-debug-info :name (component-name component)
-                                :fun-map fun-map))))
+                                :fun-map fun-map
+                                #!+(and x86-64 sb-gc-safepoint)
+                                :stack-maps
+                                #!+(and x86-64 sb-gc-safepoint)
+                                (compute-stack-maps component)))))
 
 ;;; Write BITS out to BYTE-BUFFER in backend byte order. The length of
 ;;; BITS must be evenly divisible by eight.
@@ -399,6 +399,10 @@
   (alien-stack-start :c-type "lispobj *" :length #!+alpha 2 #!-alpha 1)
   (alien-stack-pointer :c-type "lispobj *" :length #!+alpha 2 #!-alpha 1)
   #!+win32 (private-events :c-type "struct private_events" :length 2)
+  ;; pages reserved by the thread for large objects, see
+  ;; gc_alloc_large_cached() in gencgc.c
+  #!+(and gencgc sb-thread)
+  (large-page-cache :c-type "struct alloc_region" :length 5)
   (this :c-type "struct thread *" :length #!+alpha 2 #!-alpha 1)
   (prev :c-type "struct thread *" :length #!+alpha 2 #!-alpha 1)
   (next :c-type "struct thread *" :length #!+alpha 2 #!-alpha 1)
@@ -434,6 +438,10 @@
   (csp-around-foreign-call :c-type "lispobj *" :length 1)
   #!+sb-gc-safepoint
   (pc-around-foreign-call :c-type "lispobj *" :length 1)
+  ;; the Lisp frame pointer at the last foreign call, from which the
+  ;; collector walks the frames above it
+  #!+sb-gc-safepoint
+  (fp-around-foreign-call :c-type "lispobj *" :length 1)
   #!+sb-gc-safepoint
   (gc-safepoint-context :c-type "os_context_t *" :length 1)
   #!+win32
@@ -28,6 +28,34 @@
   #!-gencgc
   (%primitive allocate-code-object boxed unboxed))
 
+;;; With --perf-map, tell the runtime where the functions in CODE-OBJ
+;;; live so that it can write them to the perf(1) map file. Code stays
+;;; put once allocated, so this only needs doing once per object. The
+;;; runtime walks the debug info of CODE-OBJ, which the GC could move
+;;; from under it otherwise.
+(defun note-code-for-perf-map (code-obj)
+  #!+(and linux (or x86 x86-64))
+  (unless (zerop (extern-alien "perf_map_enabled" int))
+    (without-gcing
+      (alien-funcall (extern-alien "perf_map_note_code"
+                                   (function void unsigned))
+                     (get-lisp-obj-address code-obj))))
+  (values))
+
+;;; Note all the code already in the heap, for a core that was started
+;;; with --perf-map.
+(defun note-all-code-for-perf-map ()
+  #!+(and linux (or x86 x86-64))
+  (unless (zerop (extern-alien "perf_map_enabled" int))
+    (without-gcing
+      (sb!vm::map-allocated-objects
+       (lambda (obj widetag size)
+         (declare (ignore size))
+         (when (= widetag sb!vm:code-header-widetag)
+           (note-code-for-perf-map obj)))
+       :all)))
+  (values))
+
 ;;; Make a function entry, filling in slots from the ENTRY-INFO.
 (defun make-fun-entry (entry-info code-obj object)
   (declare (type entry-info entry-info) (type core-object object))
@@ -113,5 +141,6 @@
                 (reference-core-fun code-obj index (cdr const) object))
                (:fdefinition
                 (setf (code-header-ref code-obj index)
-                      (fdefinition-object (cdr const) t))))))))))
+                      (fdefinition-object (cdr const) t)))))))
+      (note-code-for-perf-map code-obj)))
   (values))
@@ -305,6 +305,10 @@
     ;; MS_ABI: shadow zone
     #!+win32
     (inst sub rsp-tn #x20)
+    ;; Save the frame pointer, for walking the Lisp frames. Only read
+    ;; while the stack top is set, so it has to go first.
+    #!+sb-gc-safepoint
+    (storew rbp-tn thread-base-tn thread-fp-around-foreign-call-slot)
     ;; Store used stack top
     #!+sb-gc-safepoint
     (storew rsp-tn thread-base-tn thread-saved-csp-offset)
@@ -14,6 +14,7 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
 #include "sbcl.h"
 #if defined(LISP_FEATURE_WIN32) && defined(LISP_FEATURE_SB_THREAD)
 #include "pthreads_win32.h"
@@ -45,6 +46,9 @@
 # include "dlfcn.h"
 #endif
 
+/* Set by --perf-map. */
+boolean perf_map_enabled = 0;
+
 #if !(defined(LISP_FEATURE_X86) || defined(LISP_FEATURE_X86_64))
 
 /* KLUDGE: Sigh ... I know what the call frame looks like and it had
@@ -397,7 +401,12 @@ static void
 sbcl_putwc(wchar_t c, FILE *file)
 {
 #ifdef LISP_FEATURE_OS_PROVIDES_PUTWC
-    putwc(c, file);
+    /* A stream that has already seen byte output refuses wide
+     * characters, so keep ASCII on the narrow path. */
+    if (c < 128)
+        fputc(c, file);
+    else
+        putwc(c, file);
 #else
     if (c < 256) {
         fputc(c, file);
@@ -408,7 +417,7 @@ sbcl_putwc(wchar_t c, FILE *file)
 }
 
 static void
-print_string (lispobj *object)
+print_string (FILE *f, lispobj *object)
 {
   int tag = widetag_of(*object);
   struct vector *vector = (struct vector *) object;
@@ -421,8 +430,8 @@ print_string (lispobj *object)
     for (i = 0; i < n; i++) {                   \
       wchar_t c = (wchar_t) data[i];            \
       if (c == '\\' || c == '"')                \
-        putchar('\\');                          \
-      sbcl_putwc(c, stdout);                    \
+        fputc('\\', f);                         \
+      sbcl_putwc(c, f);                         \
     }                                           \
   } while (0)
 
@@ -436,24 +445,24 @@ print_string (lispobj *object)
     break;
 #endif
   default:
-    printf("<??? type %d>", tag);
+    fprintf(f, "<??? type %d>", tag);
   }
 #undef doit
 }
 
 static void
-print_entry_name (lispobj name)
+print_entry_name (FILE *f, lispobj name)
 {
   if (lowtag_of (name) == LIST_POINTER_LOWTAG) {
-    putchar('(');
+    fputc('(', f);
     while (name != NIL) {
       struct cons *cons = (struct cons *) native_pointer(name);
-      print_entry_name(cons->car);
+      print_entry_name(f, cons->car);
       name = cons->cdr;
       if (name != NIL)
-        putchar(' ');
+        fputc(' ', f);
     }
-    putchar(')');
+    fputc(')', f);
   } else if (lowtag_of(name) == OTHER_POINTER_LOWTAG) {
     lispobj *object = (lispobj *) native_pointer(name);
     if (widetag_of(*object) == SYMBOL_HEADER_WIDETAG) {
@@ -462,25 +471,25 @@ print_entry_name (lispobj name)
         struct package *pkg
           = (struct package *) native_pointer(symbol->package);
         lispobj pkg_name = pkg->_name;
-        print_string(native_pointer(pkg_name));
-        fputs("::", stdout);
+        print_string(f, native_pointer(pkg_name));
+        fputs("::", f);
       }
-      print_string(native_pointer(symbol->name));
+      print_string(f, native_pointer(symbol->name));
     } else if (widetag_of(*object) == SIMPLE_BASE_STRING_WIDETAG) {
-         putchar('"');
-         print_string(object);
-         putchar('"');
+         fputc('"', f);
+         print_string(f, object);
+         fputc('"', f);
 #ifdef SIMPLE_CHARACTER_STRING_WIDETAG
       } else if (widetag_of(*object) == SIMPLE_CHARACTER_STRING_WIDETAG) {
-         putchar('"');
-         print_string(object);
-         putchar('"');
+         fputc('"', f);
+         print_string(f, object);
+         fputc('"', f);
 #endif
     } else {
-      printf("<??? type %d>", (int) widetag_of(*object));
+      fprintf(f, "<??? type %d>", (int) widetag_of(*object));
     }
   } else {
-    printf("<??? lowtag %d>", (int) lowtag_of(name));
+    fprintf(f, "<??? lowtag %d>", (int) lowtag_of(name));
   }
 }
 
@@ -491,7 +500,7 @@ print_entry_points (struct code *code)
 
   while (function != NIL) {
     struct simple_fun *header = (struct simple_fun *) native_pointer(function);
-    print_entry_name(header->name);
+    print_entry_name(stdout, header->name);
 
     function = header->next;
     if (function != NIL)
@@ -530,6 +539,95 @@ describe_thread_state(void)
     printf("Pending handler = %p\n", data->pending_handler);
 }
 
+#ifdef LISP_FEATURE_LINUX
+/* Linux perf(1) symbolizes JIT code from /tmp/perf-<pid>.map, which
+ * holds one "START LENGTH NAME" line (hexadecimal, no 0x prefix) per
+ * range of code.  Each code object is noted once, when it is made:
+ * the collector leaves code pages in place (see code_stays_p() in
+ * gencgc.c), so the addresses stay valid for the life of the process.
+ * Callers keep the GC from moving the debug info while it is read;
+ * perf_map_lock keeps threads from opening the file twice or mixing
+ * their lines. */
+static FILE *perf_map_file;
+#ifdef LISP_FEATURE_SB_THREAD
+static pthread_mutex_t perf_map_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+perf_map_note_range(uword_t start, uword_t end, lispobj name)
+{
+  if (end <= start)
+    return;
+  fprintf(perf_map_file, "%lx %lx ", (unsigned long) start,
+          (unsigned long) (end - start));
+  print_entry_name(perf_map_file, name);
+  fputc('\n', perf_map_file);
+}
+
+void
+perf_map_note_code(lispobj object)
+{
+  struct code *code = (struct code *) native_pointer(object);
+  uword_t start = (uword_t) code + HeaderValue(code->header) * N_WORD_BYTES;
+  uword_t end = start + fixnum_value(code->code_size) * N_WORD_BYTES;
+
+  if (!perf_map_enabled)
+    return;
+  thread_mutex_lock(&perf_map_lock);
+  if (!perf_map_file) {
+    char path[64];
+    sprintf(path, "/tmp/perf-%d.map", (int) getpid());
+    perf_map_file = fopen(path, "a");
+    if (!perf_map_file) {
+      perror(path);
+      perf_map_enabled = 0;
+      thread_mutex_unlock(&perf_map_lock);
+      return;
+    }
+  }
+
+  if (lowtag_of(code->debug_info) == INSTANCE_POINTER_LOWTAG) {
+    /* The fun map alternates debug funs with the offsets at which the
+     * next one starts; each debug fun also owns the elsewhere code
+     * from its ELSEWHERE-PC up to that of the next one.  See
+     * debug_function_from_pc(). */
+    struct compiled_debug_info *di
+      = (struct compiled_debug_info *) native_pointer(code->debug_info);
+    struct vector *v = (struct vector *) native_pointer(di->fun_map);
+    int i, len = fixnum_value(v->length);
+    struct compiled_debug_fun *first
+      = (struct compiled_debug_fun *) native_pointer(v->data[0]);
+    uword_t elsewhere = start + fixnum_value(first->elsewhere_pc);
+
+    for (i = 0; i < len; i += 2) {
+      struct compiled_debug_fun *df
+        = (struct compiled_debug_fun *) native_pointer(v->data[i]);
+      uword_t from = i ? start + fixnum_value(v->data[i - 1]) : start;
+      uword_t to = (i + 1 < len) ? start + fixnum_value(v->data[i + 1])
+                                 : elsewhere;
+      uword_t else_from = start + fixnum_value(df->elsewhere_pc);
+      uword_t else_to = end;
+      if (i + 2 < len) {
+        struct compiled_debug_fun *next
+          = (struct compiled_debug_fun *) native_pointer(v->data[i + 2]);
+        else_to = start + fixnum_value(next->elsewhere_pc);
+      }
+      perf_map_note_range(from, to < elsewhere ? to : elsewhere, df->name);
+      perf_map_note_range(else_from, else_to, df->name);
+    }
+  } else {
+    /* No debug info: attribute everything to the first entry point. */
+    if (code->entry_points != NIL) {
+      struct simple_fun *fun
+        = (struct simple_fun *) native_pointer(code->entry_points);
+      perf_map_note_range(start, end, fun->name);
+    }
+  }
+  fflush(perf_map_file);
+  thread_mutex_unlock(&perf_map_lock);
+}
+#endif
+
 /* This function has been split from lisp_backtrace() to enable Lisp
  * backtraces from gdb with call backtrace_from_fp(...). Useful for
  * example when debugging threading deadlocks.
@@ -554,7 +652,7 @@ backtrace_from_fp(void *fp, int nframes)
       struct code *cp = (struct code *) p;
       struct compiled_debug_fun *df = debug_function_from_pc(cp, ra);
       if (df)
-        print_entry_name(df->name);
+        print_entry_name(stdout, df->name);
       else
         print_entry_points(cp);
     } else {
@@ -594,3 +692,11 @@ lisp_backtrace(int nframes)
 }
 
 #endif
+
+#if !(defined(LISP_FEATURE_X86) || defined(LISP_FEATURE_X86_64)) \
+    || !defined(LISP_FEATURE_LINUX)
+void
+perf_map_note_code(lispobj object)
+{
+}
+#endif
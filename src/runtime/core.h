@@ -42,6 +42,18 @@ struct ndir_entry {
 extern int merge_core_pages;
 
 extern lispobj load_core_file(char *file, os_vm_offset_t offset);
+
+#ifdef LISP_FEATURE_SB_CORE_COMPRESSION
+/* A compressed space is stored as a sequence of independent zlib
+ * streams, one per CORE_COMPRESSION_CHUNK_BYTES of the space, preceded
+ * by the chunk size, the number of chunks and the compressed size of
+ * each chunk, one word apiece. The index lets both saving and loading
+ * work on the chunks in parallel. */
+#define CORE_COMPRESSION_CHUNK_BYTES (1u<<20)
+
+typedef void (*core_chunk_fun)(void *arg, uword_t chunk);
+extern void core_map_chunks(core_chunk_fun fun, void *arg, uword_t count);
+#endif
 extern os_vm_offset_t search_for_embedded_core(char *file);
 
 /* arbitrary string identifying this build, embedded in .core files to
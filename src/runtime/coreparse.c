@@ -201,66 +201,166 @@ os_vm_address_t copy_core_bytes(int fd, os_vm_offset_t offset,
 #endif
 
 #ifdef LISP_FEATURE_SB_CORE_COMPRESSION
-# define ZLIB_BUFFER_SIZE (1u<<16)
-os_vm_address_t inflate_core_bytes(int fd, os_vm_offset_t offset,
-                                   os_vm_address_t addr, int len)
+struct core_chunk_work {
+    core_chunk_fun fun;
+    void *arg;
+    uword_t next;
+    uword_t count;
+};
+
+static void *
+core_chunk_worker(void *arg)
 {
-    z_stream stream;
-    unsigned char buf[ZLIB_BUFFER_SIZE];
-    int ret;
+    struct core_chunk_work *work = arg;
+    uword_t chunk;
 
-    if (-1 == lseek(fd, offset, SEEK_SET)) {
-        lose("Unable to lseek() on corefile\n");
+    while ((chunk = __sync_fetch_and_add(&work->next, 1)) < work->count)
+        work->fun(work->arg, chunk);
+    return NULL;
+}
+
+static int
+core_chunk_threads(void)
+{
+#if defined(LISP_FEATURE_SB_THREAD) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (n > 8) ? 8 : (int)n;
+#elif defined(LISP_FEATURE_SB_THREAD) && defined(LISP_FEATURE_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 8) ? 8 : (int)info.dwNumberOfProcessors;
+#else
+    return 1;
+#endif
+}
+
+/* Call FUN on each chunk index below COUNT, spreading the calls over
+ * as many threads as there are processors (up to eight). FUN must be
+ * safe to run concurrently on different chunks. The helpers never
+ * touch Lisp, so they are started with all signals blocked. */
+void
+core_map_chunks(core_chunk_fun fun, void *arg, uword_t count)
+{
+    struct core_chunk_work work;
+#ifdef LISP_FEATURE_SB_THREAD
+    pthread_t helpers[8];
+    sigset_t all, old;
+    int i, started = 0, wanted = core_chunk_threads();
+#endif
+
+    work.fun = fun;
+    work.arg = arg;
+    work.next = 0;
+    work.count = count;
+#ifdef LISP_FEATURE_SB_THREAD
+    if ((uword_t)wanted > count)
+        wanted = (int)count;
+    sigfillset(&all);
+    thread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 1; i < wanted; i++) {
+        if (pthread_create(&helpers[started], NULL, core_chunk_worker, &work))
+            break;
+        started++;
     }
+    thread_sigmask(SIG_SETMASK, &old, 0);
+#endif
+    core_chunk_worker(&work);
+#ifdef LISP_FEATURE_SB_THREAD
+    for (i = 0; i < started; i++)
+        pthread_join(helpers[i], NULL);
+#endif
+}
+
+struct inflate_work {
+    unsigned char *in;
+    uword_t *in_offsets;
+    uword_t *in_sizes;
+    os_vm_address_t out;
+    uword_t out_len;
+    uword_t chunk_bytes;
+    int *status;
+};
+
+static void
+inflate_chunk(void *arg, uword_t chunk)
+{
+    struct inflate_work *work = arg;
+    uword_t start = chunk * work->chunk_bytes;
+    uLongf len = (work->out_len - start > work->chunk_bytes)
+        ? work->chunk_bytes : work->out_len - start;
+    uLongf expected = len;
+
+    work->status[chunk] = uncompress((void*)(work->out + start), &len,
+                                     work->in + work->in_offsets[chunk],
+                                     work->in_sizes[chunk]);
+    if (work->status[chunk] == Z_OK && len != expected)
+        work->status[chunk] = Z_DATA_ERROR;
+}
+
+static void
+read_core_bytes(int fd, void *buf, uword_t bytes)
+{
+    char *p = buf;
 
-    stream.zalloc = NULL;
-    stream.zfree = NULL;
-    stream.opaque = NULL;
-    stream.avail_in = 0;
-    stream.next_in = buf;
-
-    ret = inflateInit(&stream);
-    if (ret != Z_OK)
-        lose("zlib error %i\n", ret);
-
-    stream.next_out  = (void*)addr;
-    stream.avail_out = len;
-    do {
-        ssize_t count = read(fd, buf, sizeof(buf));
-        if (count < 0)
+    while (bytes > 0) {
+        ssize_t count = read(fd, p, bytes);
+        if (count <= 0)
             lose("unable to read core file (errno = %i)\n", errno);
-        stream.next_in = buf;
-        stream.avail_in = count;
-        if (count == 0) break;
-        ret = inflate(&stream, Z_NO_FLUSH);
-        switch (ret) {
-        case Z_STREAM_END:
-            break;
-        case Z_OK:
-            if (stream.avail_out == 0)
-                lose("Runaway gzipped core directory... aborting\n");
-            if (stream.avail_in > 0)
-                lose("zlib inflate returned without fully"
-                     "using up input buffer... aborting\n");
-            break;
-        default:
-            lose("zlib inflate error: %i\n", ret);
-            break;
-        }
-    } while (ret != Z_STREAM_END);
-
-    if (stream.avail_out > 0) {
-        if (stream.avail_out >= os_vm_page_size)
-            fprintf(stderr, "Warning: gzipped core directory significantly"
-                    "shorter than expected (%lu bytes)", (unsigned long)stream.avail_out);
-        /* Is this needed? */
-        memset(stream.next_out, 0, stream.avail_out);
+        p += count;
+        bytes -= count;
     }
+}
+
+os_vm_address_t inflate_core_bytes(int fd, os_vm_offset_t offset,
+                                   os_vm_address_t addr, uword_t len)
+{
+    struct inflate_work work;
+    uword_t header[2], nchunks, total = 0, i;
 
-    inflateEnd(&stream);
+    if (-1 == lseek(fd, offset, SEEK_SET)) {
+        lose("Unable to lseek() on corefile\n");
+    }
+    read_core_bytes(fd, header, sizeof(header));
+    work.chunk_bytes = header[0];
+    nchunks = header[1];
+    if (work.chunk_bytes == 0
+        || nchunks != (len + work.chunk_bytes - 1) / work.chunk_bytes)
+        lose("compressed core space has a bad chunk index "
+             "(%lu chunks of %lu bytes for %lu bytes)\n",
+             (unsigned long)nchunks, (unsigned long)work.chunk_bytes,
+             (unsigned long)len);
+
+    work.in_sizes = calloc(nchunks, sizeof(uword_t));
+    work.in_offsets = calloc(nchunks, sizeof(uword_t));
+    work.status = calloc(nchunks, sizeof(int));
+    if (!work.in_sizes || !work.in_offsets || !work.status)
+        lose("unable to allocate the compressed core chunk index\n");
+    read_core_bytes(fd, work.in_sizes, nchunks * sizeof(uword_t));
+    for (i = 0; i < nchunks; i++) {
+        work.in_offsets[i] = total;
+        total += work.in_sizes[i];
+    }
+    work.in = malloc(total);
+    if (!work.in)
+        lose("unable to allocate %lu bytes for the compressed core\n",
+             (unsigned long)total);
+    read_core_bytes(fd, work.in, total);
+
+    work.out = addr;
+    work.out_len = len;
+    core_map_chunks(inflate_chunk, &work, nchunks);
+
+    for (i = 0; i < nchunks; i++)
+        if (work.status[i] != Z_OK)
+            lose("zlib inflate error %i in core chunk %lu\n",
+                 work.status[i], (unsigned long)i);
+
+    free(work.in);
+    free(work.status);
+    free(work.in_offsets);
+    free(work.in_sizes);
     return addr;
 }
-# undef ZLIB_BUFFER_SIZE
 #endif
 
 int merge_core_pages = -1;
@@ -347,6 +447,12 @@ process_directory(int fd, lispobj *ptr, int count, os_vm_offset_t file_offset)
                 lose("warning: core/runtime address mismatch: DYNAMIC_SPACE_START\n");
             }
 #endif
+#if defined(LISP_FEATURE_GENCGC) && !defined(LISP_FEATURE_HPUX)
+            /* Pages mapped from the file don't read as zero after
+             * being released to the OS; see release_page_range(). */
+            if (!compressed && (len != 0))
+                gencgc_core_mapped_end = addr + len;
+#endif
 #if defined(ALLOCATION_POINTER)
             SetSymbolValue(ALLOCATION_POINTER, (lispobj)free_pointer,0);
 #else
@@ -495,25 +601,32 @@ load_core_file(char *file, os_vm_offset_t file_offset)
             word_t data[4096];
             word_t word;
             lseek(fd, fdoffset + file_offset, SEEK_SET);
-            while ((bytes_read = read(fd, data, (size < 4096 ? size : 4096 )))
+            while ((bytes_read = read(fd, data,
+                                      (size < sizeof(data) ? size : sizeof(data))))
                     > 0)
             {
                 int i = 0;
                 size -= bytes_read;
                 while (bytes_read) {
-                    bytes_read -= sizeof(word_t);
+                    bytes_read -= 2*sizeof(word_t);
                     /* Ignore all zeroes. The size of the page table
                      * core entry was rounded up to os_vm_page_size
                      * during the save, and might now have more
                      * elements than the page table.
                      *
-                     * The low bits of each word are allocation flags.
+                     * Each page has two words: the region start
+                     * offset with the allocation flags in its low
+                     * bits, then the bytes used with the large object
+                     * flag in its low bit.
                      */
                     if ((word=data[i])) {
                         page_table[offset].region_start_offset = word & ~0x03;
                         page_table[offset].allocated = word & 0x03;
+                        word = data[i+1];
+                        page_table[offset].bytes_used = word & ~0x01;
+                        page_table[offset].large_object = word & 0x01;
                     }
-                    i++;
+                    i += 2;
                     offset++;
                 }
             }
@@ -26,7 +26,10 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include "sbcl.h"
 #if defined(LISP_FEATURE_WIN32) && defined(LISP_FEATURE_SB_THREAD)
 #include "pthreads_win32.h"
@@ -80,6 +83,7 @@ forwarding_pointer_value(lispobj *pointer) {
 }
 static inline lispobj
 set_forwarding_pointer(lispobj * pointer, lispobj newspace_copy) {
+    gc_object_reached(pointer);
 #ifdef LISP_FEATURE_GENCGC
     pointer[0]=0x01;
     pointer[1]=newspace_copy;
@@ -96,6 +100,36 @@ struct weak_pointer *weak_pointers;
 
 os_vm_size_t bytes_consed_between_gcs = 12*1024*1024;
 
+/* how long the last gc_stop_the_world() took, in microseconds */
+uword_t gc_stop_the_world_usec = 0;
+
+/* a monotonic clock in microseconds for timing GC, so that setting
+ * the system clock back can't make a pause look negative. It wraps
+ * around on 32-bit platforms, but differences of less than an hour
+ * are fine. Without CLOCK_MONOTONIC it falls back on the time of day,
+ * never going back from the last value it returned. */
+uword_t
+gc_clock_usec(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uword_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    static uword_t last = 0;
+    struct timeval tv;
+    uword_t now;
+
+    gettimeofday(&tv, NULL);
+    now = (uword_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    /* Only the collecting thread gets here, so LAST needs no lock. */
+    if ((intptr_t)(now - last) > 0)
+        last = now;
+    return last;
+#endif
+}
+
 /*
  * copying objects
  */
@@ -227,7 +261,7 @@ scav_fun_pointer(lispobj *where, lispobj object)
     }
 
     gc_assert(is_lisp_pointer(copy));
-    gc_assert(!from_space_p(copy));
+    gc_assert((copy == object) || !from_space_p(copy));
 
     *where = copy;
 
@@ -256,6 +290,12 @@ trans_code(struct code *code)
 
     gc_assert(widetag_of(first) == CODE_HEADER_WIDETAG);
 
+#ifdef LISP_FEATURE_GENCGC
+    /* Code on code pages is scavenged where it is. */
+    if (gc_keep_code_p((lispobj *)code))
+        return code;
+#endif
+
     /* prepare to transport the code vector */
     l_code = (lispobj) LOW_WORD(code) | OTHER_POINTER_LOWTAG;
 
@@ -618,7 +658,7 @@ scav_other_pointer(lispobj *where, lispobj object)
     *where = first;
 #endif
     gc_assert(is_lisp_pointer(first));
-    gc_assert(!from_space_p(first));
+    gc_assert((first == object) || !from_space_p(first));
 
     return 1;
 }
@@ -1533,6 +1573,11 @@ void scan_weak_pointers(void)
 
         if (!(is_lisp_pointer(value) && from_space_p(value)))
             continue;
+#ifdef LISP_FEATURE_GENCGC
+        /* Code left in place by the collector is still there. */
+        if (gc_code_marked_p(value))
+            continue;
+#endif
 
         /* Now, we need to check whether the object has been forwarded. If
          * it has been, the weak pointer is still good and needs to be
@@ -1579,7 +1624,11 @@ static inline int
 survived_gc_yet (lispobj obj)
 {
     return (!is_lisp_pointer(obj) || !from_space_p(obj) ||
-            forwarding_pointer_p(native_pointer(obj)));
+            forwarding_pointer_p(native_pointer(obj))
+#ifdef LISP_FEATURE_GENCGC
+            || gc_code_marked_p(obj)
+#endif
+            );
 }
 
 static inline int
@@ -1617,25 +1666,21 @@ get_array_data (lispobj array, int widetag, uword_t *length)
     }
 }
 
-/* Only need to worry about scavenging the _real_ entries in the
- * table. Phantom entries such as the hash table itself at index 0 and
- * the empty marker at index 1 were scavenged by scav_vector that
- * either called this function directly or arranged for it to be
- * called later by pushing the hash table onto weak_hash_tables. */
-static void
-scav_hash_table_entries (struct hash_table *hash_table)
+/* Check the vectors of HASH_TABLE, returning the kv_vector and,
+ * through the pointers, the next_vector length and the hash_vector
+ * (or NULL). */
+static lispobj *
+check_hash_table_vectors (struct hash_table *hash_table,
+                          uword_t *next_vector_length,
+                          lispobj **hash_vector)
 {
     lispobj *kv_vector;
     uword_t kv_length;
     lispobj *index_vector;
     uword_t length;
     lispobj *next_vector;
-    uword_t next_vector_length;
-    lispobj *hash_vector;
     uword_t hash_vector_length;
     lispobj empty_symbol;
-    lispobj weakness = hash_table->weakness;
-    uword_t i;
 
     kv_vector = get_array_data(hash_table->table,
                                SIMPLE_VECTOR_WIDETAG, &kv_length);
@@ -1649,20 +1694,20 @@ scav_hash_table_entries (struct hash_table *hash_table)
 
     next_vector = get_array_data(hash_table->next_vector,
                                  SIMPLE_ARRAY_WORD_WIDETAG,
-                                 &next_vector_length);
+                                 next_vector_length);
     if (next_vector == NULL)
         lose("invalid next_vector %x\n", hash_table->next_vector);
 
-    hash_vector = get_array_data(hash_table->hash_vector,
-                                 SIMPLE_ARRAY_WORD_WIDETAG,
-                                 &hash_vector_length);
-    if (hash_vector != NULL)
-        gc_assert(hash_vector_length == next_vector_length);
+    *hash_vector = get_array_data(hash_table->hash_vector,
+                                  SIMPLE_ARRAY_WORD_WIDETAG,
+                                  &hash_vector_length);
+    if (*hash_vector != NULL)
+        gc_assert(hash_vector_length == *next_vector_length);
 
      /* These lengths could be different as the index_vector can be a
       * different length from the others, a larger index_vector could
       * help reduce collisions. */
-     gc_assert(next_vector_length*2 == kv_length);
+     gc_assert(*next_vector_length*2 == kv_length);
 
     empty_symbol = kv_vector[1];
     /* fprintf(stderr,"* empty_symbol = %x\n", empty_symbol);*/
@@ -1671,30 +1716,238 @@ scav_hash_table_entries (struct hash_table *hash_table)
         lose("not a symbol where empty-hash-table-slot symbol expected: %x\n",
              *(lispobj *)native_pointer(empty_symbol));
     }
+    return kv_vector;
+}
+
+/* Scavenge the key and value of entry I. */
+static inline void
+scav_hash_table_entry (struct hash_table *hash_table, lispobj *kv_vector,
+                       lispobj *hash_vector, uword_t i)
+{
+    lispobj old_key = kv_vector[2*i];
+
+    scavenge(&kv_vector[2*i],2);
+
+    /* If an EQ-based key has moved, mark the hash-table for
+     * rehashing. Keys with an address-independent hash (symbols,
+     * PCL instances) have it recorded in the hash vector and can
+     * move freely. */
+    if (!hash_vector || hash_vector[i] == MAGIC_HASH_VECTOR_VALUE) {
+        lispobj new_key = kv_vector[2*i];
+
+        if (old_key != new_key && new_key != kv_vector[1]) {
+            hash_table->needs_rehash_p = T;
+        }
+    }
+}
+
+/* Only need to worry about scavenging the _real_ entries in the
+ * table. Phantom entries such as the hash table itself at index 0 and
+ * the empty marker at index 1 were scavenged by scav_vector that
+ * called this function. */
+static void
+scav_hash_table_entries (struct hash_table *hash_table)
+{
+    lispobj *kv_vector;
+    uword_t next_vector_length;
+    lispobj *hash_vector;
+    uword_t i;
+
+    kv_vector = check_hash_table_vectors(hash_table, &next_vector_length,
+                                         &hash_vector);
 
     /* Work through the KV vector. */
-    for (i = 1; i < next_vector_length; i++) {
-        lispobj old_key = kv_vector[2*i];
-        lispobj value = kv_vector[2*i+1];
-        if ((weakness == NIL) ||
-            weak_hash_entry_alivep(weakness, old_key, value)) {
-
-            /* Scavenge the key and value. */
-            scavenge(&kv_vector[2*i],2);
-
-            /* If an EQ-based key has moved, mark the hash-table for
-             * rehashing. */
-            if (!hash_vector || hash_vector[i] == MAGIC_HASH_VECTOR_VALUE) {
-                lispobj new_key = kv_vector[2*i];
-
-                if (old_key != new_key && new_key != empty_symbol) {
-                    hash_table->needs_rehash_p = T;
-                }
-            }
+    for (i = 1; i < next_vector_length; i++)
+        scav_hash_table_entry(hash_table, kv_vector, hash_vector, i);
+}
+
+/*
+ * weak hash table entries
+ *
+ * An entry of a weak table survives only once its trigger -- the key,
+ * the value, either or both, as the weakness says -- has been reached
+ * some other way, much like an ephemeron. Rather than rescanning every
+ * weak table after each round of scavenging until nothing changes,
+ * which goes quadratic with many tables, each entry is looked at when
+ * its table is first scavenged. If its trigger has survived, it is
+ * scavenged then; otherwise it waits on the trigger in a table keyed
+ * by address. Whenever an object in from_space is reached (copied,
+ * promoted in place, or marked as code which stays put),
+ * gc_object_reached() moves the entries waiting on it to the ready
+ * list, which scav_weak_hash_tables() drains between rounds. Each
+ * entry waits at most twice, so the work is linear in the number of
+ * entries.
+ */
+
+struct weak_hash_waiter {
+    lispobj *trigger;           /* object start, in from_space */
+    struct hash_table *hash_table;
+    uword_t index;
+    uword_t next;               /* in its bucket, or NO_WAITER */
+};
+
+#define NO_WAITER ((uword_t)-1)
+
+static struct weak_hash_waiter *weak_hash_waiters;
+static uword_t weak_hash_waiters_count, weak_hash_waiters_size;
+static uword_t *weak_hash_buckets;
+static uword_t weak_hash_buckets_count;
+static uword_t *weak_hash_ready;
+static uword_t weak_hash_ready_count, weak_hash_ready_size;
+
+/* the number of entries waiting, which gc_object_reached() checks
+ * before looking anything up */
+uword_t weak_hash_waiters_pending = 0;
+
+static inline uword_t
+weak_hash_bucket (lispobj *trigger)
+{
+    return ((uword_t)trigger / (2*N_WORD_BYTES)) & (weak_hash_buckets_count - 1);
+}
+
+static void *
+grow_weak_hash_array (void *array, uword_t *size, size_t element_size)
+{
+    *size = *size ? 2 * *size : 1024;
+    array = realloc(array, *size * element_size);
+    if (array == NULL)
+        lose("can't grow the weak hash table entry queue\n");
+    return array;
+}
+
+static void
+rehash_weak_hash_waiters (void)
+{
+    uword_t *old = weak_hash_buckets;
+    uword_t old_count = weak_hash_buckets_count;
+    uword_t i, j, next;
+
+    weak_hash_buckets_count = old_count ? 2 * old_count : 1024;
+    weak_hash_buckets = malloc(weak_hash_buckets_count * sizeof(uword_t));
+    if (weak_hash_buckets == NULL)
+        lose("can't grow the weak hash table entry queue\n");
+    for (i = 0; i < weak_hash_buckets_count; i++)
+        weak_hash_buckets[i] = NO_WAITER;
+    for (i = 0; i < old_count; i++)
+        for (j = old[i]; j != NO_WAITER; j = next) {
+            uword_t bucket = weak_hash_bucket(weak_hash_waiters[j].trigger);
+            next = weak_hash_waiters[j].next;
+            weak_hash_waiters[j].next = weak_hash_buckets[bucket];
+            weak_hash_buckets[bucket] = j;
         }
+    free(old);
+}
+
+/* Make entry INDEX of HASH_TABLE wait until TRIGGER is reached. */
+static void
+wait_for_weak_trigger (lispobj trigger, struct hash_table *hash_table,
+                       uword_t index)
+{
+    lispobj *where = native_pointer(trigger);
+    struct weak_hash_waiter *waiter;
+    uword_t bucket;
+
+    /* Functions and return addresses are reached as their code. */
+    if (lowtag_of(trigger) != LIST_POINTER_LOWTAG)
+        switch (widetag_of(*where)) {
+        case SIMPLE_FUN_HEADER_WIDETAG:
+        case RETURN_PC_HEADER_WIDETAG:
+            where -= HeaderValue(*where);
+            break;
+        }
+
+    if (weak_hash_waiters_count == weak_hash_waiters_size)
+        weak_hash_waiters =
+            grow_weak_hash_array(weak_hash_waiters, &weak_hash_waiters_size,
+                                 sizeof(struct weak_hash_waiter));
+    if (weak_hash_waiters_pending >= weak_hash_buckets_count)
+        rehash_weak_hash_waiters();
+
+    bucket = weak_hash_bucket(where);
+    waiter = &weak_hash_waiters[weak_hash_waiters_count];
+    waiter->trigger = where;
+    waiter->hash_table = hash_table;
+    waiter->index = index;
+    waiter->next = weak_hash_buckets[bucket];
+    weak_hash_buckets[bucket] = weak_hash_waiters_count++;
+    weak_hash_waiters_pending++;
+}
+
+/* Move the entries waiting on OBJECT, which has just been reached, to
+ * the ready list. */
+void
+wake_weak_hash_entries (lispobj *object)
+{
+    uword_t *link = &weak_hash_buckets[weak_hash_bucket(object)];
+    uword_t i;
+
+    while ((i = *link) != NO_WAITER) {
+        struct weak_hash_waiter *waiter = &weak_hash_waiters[i];
+        if (waiter->trigger == object) {
+            *link = waiter->next;
+            if (weak_hash_ready_count == weak_hash_ready_size)
+                weak_hash_ready =
+                    grow_weak_hash_array(weak_hash_ready,
+                                         &weak_hash_ready_size,
+                                         sizeof(uword_t));
+            weak_hash_ready[weak_hash_ready_count++] = i;
+            weak_hash_waiters_pending--;
+        } else
+            link = &waiter->next;
     }
 }
 
+/* Scavenge entry I of the weak HASH_TABLE if its trigger has
+ * survived, or make it wait for the part which hasn't. */
+static void
+scav_or_queue_weak_hash_entry (struct hash_table *hash_table,
+                               lispobj *kv_vector, lispobj *hash_vector,
+                               uword_t i)
+{
+    lispobj key = kv_vector[2*i];
+    lispobj value = kv_vector[2*i+1];
+
+    if (key == kv_vector[1])
+        return;
+    if (weak_hash_entry_alivep(hash_table->weakness, key, value)) {
+        scav_hash_table_entry(hash_table, kv_vector, hash_vector, i);
+        return;
+    }
+    switch (hash_table->weakness) {
+    case KEY:
+        wait_for_weak_trigger(key, hash_table, i);
+        break;
+    case VALUE:
+        wait_for_weak_trigger(value, hash_table, i);
+        break;
+    case KEY_OR_VALUE:
+        wait_for_weak_trigger(key, hash_table, i);
+        wait_for_weak_trigger(value, hash_table, i);
+        break;
+    case KEY_AND_VALUE:
+        /* Wait for one at a time. */
+        wait_for_weak_trigger(survived_gc_yet(key) ? value : key,
+                              hash_table, i);
+        break;
+    default:
+        gc_assert(0);
+    }
+}
+
+static void
+queue_weak_hash_table_entries (struct hash_table *hash_table)
+{
+    lispobj *kv_vector;
+    uword_t next_vector_length;
+    lispobj *hash_vector;
+    uword_t i;
+
+    kv_vector = check_hash_table_vectors(hash_table, &next_vector_length,
+                                         &hash_vector);
+    for (i = 1; i < next_vector_length; i++)
+        scav_or_queue_weak_hash_entry(hash_table, kv_vector, hash_vector, i);
+}
+
 intptr_t
 scav_vector (lispobj *where, lispobj object)
 {
@@ -1755,28 +2008,36 @@ scav_vector (lispobj *where, lispobj object)
 
     if (hash_table->weakness == NIL) {
         scav_hash_table_entries(hash_table);
-    } else {
-        /* Delay scavenging of this table by pushing it onto
-         * weak_hash_tables (if it's not there already) for the weak
-         * object phase. */
-        if (hash_table->next_weak_hash_table == NIL) {
-            hash_table->next_weak_hash_table = (lispobj)weak_hash_tables;
-            weak_hash_tables = hash_table;
-        }
+    } else if (hash_table->next_weak_hash_table == NIL) {
+        /* The first time round, push the table onto weak_hash_tables
+         * for scan_weak_hash_tables(), scavenge the entries whose
+         * triggers have survived and leave the others waiting. */
+        hash_table->next_weak_hash_table = (lispobj)weak_hash_tables;
+        weak_hash_tables = hash_table;
+        queue_weak_hash_table_entries(hash_table);
     }
 
     return (CEILING(kv_length + 2, 2));
 }
 
+/* Scavenge the weak hash table entries whose triggers have been
+ * reached since the last call, and whatever that reaches in turn. */
 void
 scav_weak_hash_tables (void)
 {
-    struct hash_table *table;
-
-    /* Scavenge entries whose triggers are known to survive. */
-    for (table = weak_hash_tables; table != NULL;
-         table = (struct hash_table *)table->next_weak_hash_table) {
-        scav_hash_table_entries(table);
+    while (weak_hash_ready_count) {
+        struct weak_hash_waiter *waiter =
+            &weak_hash_waiters[weak_hash_ready[--weak_hash_ready_count]];
+        struct hash_table *hash_table = waiter->hash_table;
+        uword_t index = waiter->index;
+        lispobj *hash_vector =
+            get_array_data(hash_table->hash_vector,
+                           SIMPLE_ARRAY_WORD_WIDETAG, NULL);
+        lispobj *kv_vector =
+            get_array_data(hash_table->table, SIMPLE_VECTOR_WIDETAG, NULL);
+
+        scav_or_queue_weak_hash_entry(hash_table, kv_vector, hash_vector,
+                                      index);
     }
 }
 
@@ -1813,6 +2074,33 @@ scan_weak_hash_table_chain (struct hash_table *hash_table, lispobj *prev,
     }
 }
 
+/* An open-addressing table has no chains: dead entries are emptied in
+ * place, and their slots left marked as used in the next_vector so
+ * that probes still step over them. */
+static void
+scan_weak_open_addressing_table (struct hash_table *hash_table,
+                                 lispobj *kv_vector, lispobj *hash_vector,
+                                 uword_t length, lispobj empty_symbol,
+                                 lispobj weakness)
+{
+    uword_t i;
+
+    for (i = 1; i < length; i++) {
+        lispobj key = kv_vector[2 * i];
+        lispobj value = kv_vector[2 * i + 1];
+        if (key == empty_symbol)
+            continue;
+        if (!weak_hash_entry_alivep(weakness, key, value)) {
+            unsigned count = fixnum_value(hash_table->number_entries);
+            gc_assert(count > 0);
+            hash_table->number_entries = make_fixnum(count - 1);
+            kv_vector[2 * i] = empty_symbol;
+            kv_vector[2 * i + 1] = empty_symbol;
+            hash_vector[i] = MAGIC_HASH_VECTOR_VALUE;
+        }
+    }
+}
+
 static void
 scan_weak_hash_table (struct hash_table *hash_table)
 {
@@ -1837,6 +2125,13 @@ scan_weak_hash_table (struct hash_table *hash_table)
                                  SIMPLE_ARRAY_WORD_WIDETAG, NULL);
     empty_symbol = kv_vector[1];
 
+    if (hash_table->open_addressing_p != NIL) {
+        scan_weak_open_addressing_table(hash_table, kv_vector, hash_vector,
+                                        next_vector_length, empty_symbol,
+                                        weakness);
+        return;
+    }
+
     for (i = 0; i < length; i++) {
         scan_weak_hash_table_chain(hash_table, &index_vector[i],
                                    kv_vector, index_vector, next_vector,
@@ -1857,6 +2152,16 @@ scan_weak_hash_tables (void)
     }
 
     weak_hash_tables = NULL;
+
+    /* Whatever still waits belongs to a dead entry, culled above. */
+    gc_assert(weak_hash_ready_count == 0);
+    if (weak_hash_waiters_pending) {
+        uword_t i;
+        for (i = 0; i < weak_hash_buckets_count; i++)
+            weak_hash_buckets[i] = NO_WAITER;
+        weak_hash_waiters_pending = 0;
+    }
+    weak_hash_waiters_count = 0;
 }
 
 
@@ -101,6 +101,8 @@ gc_general_alloc(sword_t nbytes, int page_type_flag, int quick_p)
     struct alloc_region *my_region;
     if (UNBOXED_PAGE_FLAG == page_type_flag) {
         my_region = &unboxed_region;
+    } else if (CODE_PAGE_FLAG == page_type_flag) {
+        my_region = &code_region;
     } else if (BOXED_PAGE_FLAG & page_type_flag) {
         my_region = &boxed_region;
     } else {
@@ -143,6 +145,18 @@ extern void scav_weak_hash_tables(void);
 extern void scan_weak_hash_tables(void);
 extern void scan_weak_pointers(void);
 
+extern uword_t weak_hash_waiters_pending; /* in gc-common.c */
+extern void wake_weak_hash_entries(lispobj *object);
+
+/* Called with the start of each object in from_space as it is first
+ * reached, to wake the weak hash table entries waiting on it. */
+static inline void
+gc_object_reached(lispobj *object)
+{
+    if (weak_hash_waiters_pending)
+        wake_weak_hash_entries(object);
+}
+
 lispobj  copy_large_unboxed_object(lispobj object, sword_t nwords);
 lispobj  copy_unboxed_object(lispobj object, sword_t nwords);
 lispobj  copy_large_object(lispobj object, sword_t nwords);
@@ -160,6 +174,9 @@ extern int looks_like_valid_lisp_pointer_p(lispobj pointer, lispobj *start_addr)
 extern void scavenge_control_stack(struct thread *th);
 extern void scrub_control_stack();
 
+extern uword_t gc_clock_usec(void);
+extern uword_t gc_stop_the_world_usec;
+
 #include "fixnump.h"
 
 #ifdef LISP_FEATURE_GENCGC
@@ -46,5 +46,11 @@ extern void clear_auto_gc_trigger(void);
 extern boolean maybe_gc(os_context_t *context);
 
 extern os_vm_size_t bytes_consed_between_gcs;
+#ifdef LISP_FEATURE_GENCGC
+extern int gencgc_gc_threads;
+#ifdef LISP_FEATURE_SB_THREAD
+extern boolean gencgc_background_release;
+#endif
+#endif
 
 #endif /* _GC_H_ */
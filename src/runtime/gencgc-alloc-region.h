@@ -23,6 +23,7 @@ struct alloc_region {
 
 extern struct alloc_region  boxed_region;
 extern struct alloc_region  unboxed_region;
+extern struct alloc_region  code_region;
 extern generation_index_t from_space, new_space;
 extern struct weak_pointer *weak_pointers;
 
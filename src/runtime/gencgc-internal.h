@@ -117,6 +117,9 @@ intptr_t update_dynamic_space_free_pointer(void);
 void gc_alloc_update_page_tables(int page_type_flag, struct alloc_region *alloc_region);
 void gc_alloc_update_all_page_tables(void);
 void gc_set_region_empty(struct alloc_region *region);
+#ifdef LISP_FEATURE_SB_THREAD
+void gc_flush_large_page_cache(struct alloc_region *cache);
+#endif
 
 /*
  * predicates
@@ -149,5 +152,9 @@ new_space_p(lispobj obj)
 
 extern page_index_t last_free_page;
 extern boolean gencgc_partial_pickup;
+extern os_vm_address_t gencgc_core_mapped_end;
+
+extern boolean gc_keep_code_p(lispobj *code);
+extern boolean gc_code_marked_p(lispobj obj);
 
 #endif
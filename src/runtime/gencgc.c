@@ -55,6 +55,7 @@
 #include "genesis/hash-table.h"
 #include "genesis/instance.h"
 #include "genesis/layout.h"
+#include "genesis/compiled-debug-info.h"
 #include "gencgc.h"
 #if !defined(LISP_FEATURE_X86) && !defined(LISP_FEATURE_X86_64)
 #include "genesis/cons.h"
@@ -81,6 +82,12 @@ enum {
  * that don't have pointers to younger generations? */
 boolean enable_page_protection = 1;
 
+/* Boxed pages which keep being written to between collections cost a
+ * write fault and two mprotect() calls per collection. Once a page has
+ * faulted this often it is left unprotected, and so is scavenged as if
+ * dirty, until it cools down. Zero protects pages unconditionally. */
+int gencgc_hot_page_faults = 4;
+
 /* the minimum size (in bytes) for a large object*/
 #if (GENCGC_ALLOC_GRANULARITY >= PAGE_BYTES) && (GENCGC_ALLOC_GRANULARITY >= GENCGC_CARD_BYTES)
 os_vm_size_t large_object_size = 4 * GENCGC_ALLOC_GRANULARITY;
@@ -177,6 +184,44 @@ static boolean conservative_stack = 1;
 page_index_t page_table_pages;
 struct page *page_table;
 
+/* per-page write fault history, see gencgc_hot_page_faults */
+static unsigned char *page_wp_faults;
+#define PAGE_WP_FAULTS_MAX 32
+
+/* One bit per two words of dynamic space, set where an object starts,
+ * so that conservative roots can be resolved to their objects without
+ * walking whole regions. The bits for a page are filled in the first
+ * time a GC needs them and cleared when it is freed; page_starts_bytes
+ * says how much of each page they cover, so that a page which has had
+ * objects allocated onto it since is filled again. */
+static uword_t *object_start_bits;
+static page_bytes_t *page_starts_bytes;
+#define OBJECT_START_BITS_PER_PAGE (GENCGC_CARD_BYTES / (2*N_WORD_BYTES))
+static void clear_object_starts(page_index_t page);
+
+/* Mark bits for the code objects which a collection leaves in place,
+ * laid out like object_start_bits. The bit for the first two words of
+ * a code object says that it has been reached, and the bit after it
+ * that it has been scavenged; every code object is at least four words
+ * long, so the pair never runs into the next object. Pages from
+ * code_scan_start up to code_scan_end may hold reached objects which
+ * have not been scavenged yet. */
+static uword_t *code_mark_bits;
+static page_index_t code_scan_start, code_scan_end;
+
+/* The holes which dead code leaves in the code blocks a collection
+ * keeps, for new code objects to be allocated into. Each hole is
+ * unboxed filler with the next hole of its bin in its first data word;
+ * bin i holds the holes of 2^(i+2) up to 2^(i+3) words, except that
+ * the last one holds all the bigger ones too. */
+#define CODE_HOLE_BINS 16
+static lispobj *code_holes[CODE_HOLE_BINS];
+
+static inline boolean page_hot_p(page_index_t page) {
+    return (gencgc_hot_page_faults
+            && (page_wp_faults[page] >= gencgc_hot_page_faults));
+}
+
 static inline boolean page_allocated_p(page_index_t page) {
     return (page_table[page].allocated != FREE_PAGE_FLAG);
 }
@@ -321,6 +366,10 @@ struct generation {
      * prevent a GC when a large number of new live objects have been
      * added, in which case a GC could be a waste of time */
     uword_t minimum_age_before_gc;
+
+    /* the most bytes a GC of this generation may copy, or 0 for as
+     * many as the free space allows */
+    os_vm_size_t evacuation_limit;
 };
 
 /* an array of generation structures. There needs to be one more
@@ -342,6 +391,40 @@ struct generation generations[NUM_GENERATIONS];
  * data can be avoided. */
 generation_index_t gencgc_oldest_gen_to_gc = HIGHEST_NORMAL_GENERATION;
 
+/* The pause time in microseconds which collections should aim for, or
+ * 0 to leave the nursery size and promotion settings as they are.
+ * Otherwise each collection adjusts them for the next, from how long
+ * it took and how much of what it collected survived. Set from Lisp
+ * with (SETF SB-EXT:GC-PAUSE-TARGET). */
+int gencgc_pause_target = 0;
+
+/* A record of the last GC_EVENT_LOG_SIZE collections, for SB-EXT:GC-EVENTS
+ * which knows the layout. Times are in microseconds; the per-generation
+ * entries are for each generation up to and including the oldest one
+ * collected, and RAISED has a bit set for each one that was promoted. */
+#define GC_EVENT_LOG_SIZE 64
+#define GC_EVENT_GENERATIONS (PSEUDO_STATIC_GENERATION+1)
+
+struct gc_event {
+    os_vm_size_t number;
+    os_vm_size_t generation;
+    os_vm_size_t stop_usec;
+    os_vm_size_t roots_usec;
+    os_vm_size_t scavenge_usec;
+    os_vm_size_t weak_usec;
+    os_vm_size_t free_usec;
+    os_vm_size_t total_usec;
+    os_vm_size_t raised;
+    os_vm_size_t bytes_before[GC_EVENT_GENERATIONS];
+    os_vm_size_t bytes_survived[GC_EVENT_GENERATIONS];
+};
+
+struct gc_event gc_events[GC_EVENT_LOG_SIZE];
+/* the number of collections recorded so far */
+os_vm_size_t gc_event_count = 0;
+/* the entry for the collection in progress */
+static struct gc_event *gc_event;
+
 /* The maximum free page in the heap is maintained and used to update
  * ALLOCATION_POINTER which is used by the room function to limit its
  * search of the heap. XX Gencgc obviously needs to be better
@@ -366,6 +449,33 @@ os_vm_size_t gencgc_release_granularity = GENCGC_RELEASE_GRANULARITY;
 extern os_vm_size_t gencgc_alloc_granularity;
 os_vm_size_t gencgc_alloc_granularity = GENCGC_ALLOC_GRANULARITY;
 
+#ifdef LISP_FEATURE_SB_THREAD
+/* Large objects allocated by Lisp threads are carved out of a run of
+ * pages of about this size reserved by the thread, so that
+ * free_pages_lock is taken once per run instead of once per object.
+ * Objects bigger than a quarter of it, or any object when it is zero,
+ * take the shared path. */
+os_vm_size_t gencgc_large_page_cache_bytes = 64 * GENCGC_CARD_BYTES;
+#endif
+
+/* the number of threads, including the collecting thread, which share
+ * the write-protection rescan in scavenge_generations(), the only
+ * phase run by gc_run_parallel() so far. Set with --gc-threads. */
+int gencgc_gc_threads = 1;
+
+/* Code objects on code pages normally stay where they were allocated:
+ * a collection marks the ones it reaches and scavenges them in place,
+ * and fills in the rest. gc_and_save() sets this to copy them instead,
+ * compacting the heap one last time. */
+boolean gencgc_move_code = 0;
+
+#if defined(LISP_FEATURE_X86_64) && defined(LISP_FEATURE_SB_GC_SAFEPOINT)
+/* Scan Lisp frames using the stack maps recorded by the compiler,
+ * rather than treating every word of the control stack as a possible
+ * pointer. Set to zero to go back to fully conservative stacks. */
+boolean gencgc_precise_stack = 1;
+#endif
+
 
 /*
  * miscellaneous heap functions
@@ -730,10 +840,15 @@ zero_dirty_pages(page_index_t start, page_index_t end) {
  * unboxed objects the whole page never needs scavenging or
  * write-protecting. */
 
-/* We are only using two regions at present. Both are for the current
- * newspace generation. */
+/* The GC copies into three regions, all for the current newspace
+ * generation. Code objects get a region of their own so that they end
+ * up on pages which hold nothing else: code is hardly ever written
+ * once it has been loaded, so pages of code mapped from a saved core
+ * stay clean and are shared by every process started from that core,
+ * instead of being copied when a neighbouring symbol or cons is set. */
 struct alloc_region boxed_region;
 struct alloc_region unboxed_region;
+struct alloc_region code_region;
 
 /* The generation currently being allocated to. */
 static generation_index_t gc_alloc_generation;
@@ -1119,14 +1234,19 @@ gc_alloc_update_page_tables(int page_type_flag, struct alloc_region *alloc_regio
         /* There are no bytes allocated. Unallocate the first_page if
          * there are 0 bytes_used. */
         page_table[first_page].allocated &= ~(OPEN_REGION_PAGE_FLAG);
-        if (page_table[first_page].bytes_used == 0)
+        if (page_table[first_page].bytes_used == 0) {
             page_table[first_page].allocated = FREE_PAGE_FLAG;
+            page_wp_faults[first_page] = 0;
+            clear_object_starts(first_page);
+        }
     }
 
     /* Unallocate any unused pages. */
     while (next_page <= alloc_region->last_page) {
         gc_assert(page_table[next_page].bytes_used == 0);
         page_table[next_page].allocated = FREE_PAGE_FLAG;
+        page_wp_faults[next_page] = 0;
+        clear_object_starts(next_page);
         next_page++;
     }
     ret = thread_mutex_unlock(&free_pages_lock);
@@ -1292,14 +1412,16 @@ gc_heap_exhausted_error_or_lose (intptr_t available, intptr_t requested)
     }
 }
 
-page_index_t
-gc_find_freeish_pages(page_index_t *restart_page_ptr, sword_t bytes,
-                      int page_type_flag)
+/* As gc_find_freeish_pages(), but keep looking for a run of up to
+ * GOAL bytes when one of BYTES has been found. */
+static page_index_t
+find_freeish_pages(page_index_t *restart_page_ptr, sword_t bytes,
+                   os_vm_size_t goal, int page_type_flag)
 {
     page_index_t most_bytes_found_from = 0, most_bytes_found_to = 0;
     page_index_t first_page, last_page, restart_page = *restart_page_ptr;
     os_vm_size_t nbytes = bytes;
-    os_vm_size_t nbytes_goal = nbytes;
+    os_vm_size_t nbytes_goal = goal;
     os_vm_size_t bytes_found = 0;
     os_vm_size_t most_bytes_found = 0;
     boolean small_object = nbytes < GENCGC_CARD_BYTES;
@@ -1384,6 +1506,152 @@ gc_find_freeish_pages(page_index_t *restart_page_ptr, sword_t bytes,
     return most_bytes_found_to-1;
 }
 
+page_index_t
+gc_find_freeish_pages(page_index_t *restart_page_ptr, sword_t bytes,
+                      int page_type_flag)
+{
+    return find_freeish_pages(restart_page_ptr, bytes, bytes, page_type_flag);
+}
+
+#ifdef LISP_FEATURE_SB_THREAD
+/*
+ * per-thread large object page caches
+ *
+ * A cache is a run of free pages claimed under free_pages_lock on
+ * behalf of one thread, described by an alloc_region: start_addr and
+ * end_addr bound the run, and free_pointer is the first page not yet
+ * handed out. The pages are marked as open boxed large object pages
+ * with nothing in use, which keeps other threads from picking them up
+ * and the rest of the collector from looking at them, so the owner can
+ * fill in bytes_used and region_start_offset without the lock. The
+ * whole run counts as allocated until the cache is flushed.
+ */
+
+/* Give back the unused pages of CACHE and close the pages handed out
+ * from it. */
+void
+gc_flush_large_page_cache(struct alloc_region *cache)
+{
+    page_index_t first_page = cache->first_page;
+    page_index_t last_page = cache->last_page;
+    page_index_t next_page, i;
+    os_vm_size_t unused;
+    int ret;
+
+    /* Catch an unused cache. */
+    if ((first_page == 0) && (last_page == -1))
+        return;
+
+    next_page = find_page_index(cache->free_pointer);
+    if (next_page == -1)
+        next_page = last_page + 1;
+    unused = npage_bytes(last_page + 1 - next_page);
+
+    ret = thread_mutex_lock(&free_pages_lock);
+    gc_assert(ret == 0);
+    for (i = first_page; i <= last_page; i++) {
+        gc_assert(page_table[i].large_object);
+        page_table[i].allocated &= ~OPEN_REGION_PAGE_FLAG;
+        if (i < next_page) {
+            /* Slack at the end of an object's last page. */
+            unused += GENCGC_CARD_BYTES - page_table[i].bytes_used;
+        } else {
+            gc_assert(page_table[i].bytes_used == 0);
+            page_table[i].allocated = FREE_PAGE_FLAG;
+            page_table[i].large_object = 0;
+            page_wp_faults[i] = 0;
+            clear_object_starts(i);
+        }
+    }
+    bytes_allocated -= unused;
+    generations[page_table[first_page].gen].bytes_allocated -= unused;
+    ret = thread_mutex_unlock(&free_pages_lock);
+    gc_assert(ret == 0);
+
+    gc_set_region_empty(cache);
+}
+
+/* Reserve a fresh run of pages for CACHE with room for at least
+ * NBYTES. */
+static void
+gc_refill_large_page_cache(sword_t nbytes, struct alloc_region *cache)
+{
+    page_index_t first_page, last_page, i;
+    os_vm_size_t reserved;
+    int ret;
+
+    gc_flush_large_page_cache(cache);
+
+    ret = thread_mutex_lock(&free_pages_lock);
+    gc_assert(ret == 0);
+
+    first_page = generation_alloc_start_page(gc_alloc_generation, BOXED_PAGE_FLAG, 1);
+    last_page = find_freeish_pages(&first_page, nbytes,
+                                   gencgc_large_page_cache_bytes,
+                                   BOXED_PAGE_FLAG);
+    set_generation_alloc_start_page(gc_alloc_generation, BOXED_PAGE_FLAG, 1, last_page);
+
+    for (i = first_page; i <= last_page; i++) {
+        gc_assert(page_free_p(i));
+        page_table[i].allocated = BOXED_PAGE_FLAG | OPEN_REGION_PAGE_FLAG;
+        page_table[i].gen = gc_alloc_generation;
+        page_table[i].large_object = 1;
+        page_table[i].region_start_offset = 0;
+        page_table[i].write_protected = 0;
+        page_table[i].dont_move = 0;
+    }
+    reserved = npage_bytes(1 + last_page - first_page);
+    bytes_allocated += reserved;
+    generations[gc_alloc_generation].bytes_allocated += reserved;
+
+    /* Bump up last_free_page */
+    if (last_page+1 > last_free_page) {
+        last_free_page = last_page+1;
+        set_alloc_pointer((lispobj)(page_address(last_free_page)));
+    }
+    ret = thread_mutex_unlock(&free_pages_lock);
+    gc_assert(ret == 0);
+
+#ifdef LISP_FEATURE_WIN32
+    os_validate_recommit(page_address(first_page), reserved);
+#endif
+
+    cache->first_page = first_page;
+    cache->last_page = last_page;
+    cache->start_addr = page_address(first_page);
+    cache->free_pointer = cache->start_addr;
+    cache->end_addr = page_address(last_page + 1);
+}
+
+/* Allocate a large object of NBYTES from the thread's CACHE, which
+ * is refilled as needed. */
+static void *
+gc_alloc_large_cached(sword_t nbytes, struct alloc_region *cache)
+{
+    page_index_t first_page, last_page, i;
+    os_vm_size_t bytes_left = nbytes;
+    void *new_obj;
+
+    if (cache->free_pointer + nbytes > cache->end_addr)
+        gc_refill_large_page_cache(nbytes, cache);
+
+    new_obj = cache->free_pointer;
+    first_page = find_page_index(new_obj);
+    last_page = find_page_index(new_obj + nbytes - 1);
+    for (i = first_page; i <= last_page; i++) {
+        page_table[i].region_start_offset = npage_bytes(i - first_page);
+        page_table[i].bytes_used =
+            (bytes_left > GENCGC_CARD_BYTES) ? GENCGC_CARD_BYTES : bytes_left;
+        bytes_left -= page_table[i].bytes_used;
+    }
+    cache->free_pointer = page_address(last_page + 1);
+
+    zero_dirty_pages(first_page, last_page);
+
+    return new_obj;
+}
+#endif
+
 /* Allocate bytes.  All the rest of the special-purpose allocation
  * functions will eventually call this  */
 
@@ -1563,6 +1831,8 @@ general_copy_large_object(lispobj object, word_t nwords, boolean boxedp)
             old_bytes_used = page_table[next_page].bytes_used;
             page_table[next_page].allocated = FREE_PAGE_FLAG;
             page_table[next_page].bytes_used = 0;
+            page_wp_faults[next_page] = 0;
+            clear_object_starts(next_page);
             bytes_freed += old_bytes_used;
             next_page++;
         }
@@ -1582,6 +1852,7 @@ general_copy_large_object(lispobj object, word_t nwords, boolean boxedp)
         if (boxedp)
             add_new_area(first_page,0,nwords*N_WORD_BYTES);
 
+        gc_object_reached(native_pointer(object));
         return(object);
 
     } else {
@@ -2015,6 +2286,143 @@ search_static_space(void *pointer)
                             (lispobj *) pointer));
 }
 
+/* Return the size in words of the object at WHERE, which must be an
+ * object start in a boxed page. Objects are dual-word aligned. */
+static inline sword_t
+object_size_words(lispobj *where)
+{
+    lispobj thing = *where;
+
+    /* If thing is an immediate then this is a cons. */
+    if (is_lisp_pointer(thing) || is_lisp_immediate(thing))
+        return 2;
+    return CEILING((sizetab[widetag_of(thing)])(where), 2);
+}
+
+static inline boolean
+page_aligned_p(void *addr)
+{
+    return ((uword_t)addr & (GENCGC_CARD_BYTES - 1)) == 0;
+}
+
+static inline uword_t
+object_start_bit(void *addr)
+{
+    return ((uword_t)addr - DYNAMIC_SPACE_START) / (2*N_WORD_BYTES);
+}
+
+static inline boolean
+object_start_p(void *addr)
+{
+    uword_t bit = object_start_bit(addr);
+    return (object_start_bits[bit / N_WORD_BITS] >> (bit % N_WORD_BITS)) & 1;
+}
+
+static inline int
+highest_bit(uword_t word)
+{
+#if N_WORD_BITS == 64
+    return 63 - __builtin_clzll(word);
+#else
+    return 31 - __builtin_clz(word);
+#endif
+}
+
+static inline void
+set_object_start(void *addr)
+{
+    uword_t bit = object_start_bit(addr);
+    object_start_bits[bit / N_WORD_BITS] |= (uword_t)1 << (bit % N_WORD_BITS);
+}
+
+/* Forget the object starts from START up to END. */
+static void
+clear_object_start_range(lispobj *start, lispobj *end)
+{
+    uword_t bit;
+
+    for (bit = object_start_bit(start); bit < object_start_bit(end); bit++)
+        object_start_bits[bit / N_WORD_BITS] &=
+            ~((uword_t)1 << (bit % N_WORD_BITS));
+}
+
+/* Forget the object starts on PAGE, which is being freed. */
+static void
+clear_object_starts(page_index_t page)
+{
+    memset(object_start_bits
+           + object_start_bit(page_address(page)) / N_WORD_BITS,
+           0, OBJECT_START_BITS_PER_PAGE / 8);
+    page_starts_bytes[page] = 0;
+}
+
+/* Make sure that the object start bits cover all of PAGE, a page of a
+ * closed region of small objects, by walking its region if they
+ * don't. Only the collector may do this, while the world is stopped:
+ * a mutator's objects are only sure to be complete then. */
+static void
+fill_object_starts(page_index_t page)
+{
+    lispobj *start, *where, *end;
+    page_index_t i;
+
+    if (page_starts_bytes[page] == page_table[page].bytes_used)
+        return;
+    start = (lispobj *)page_region_start(page);
+    end = (lispobj *)(page_address(page) + page_table[page].bytes_used);
+    for (where = start; where < end; where += object_size_words(where))
+        set_object_start(where);
+    /* The first page is only covered if the region starts with it. */
+    for (i = find_page_index(start) + !page_aligned_p(start); i <= page; i++)
+        page_starts_bytes[i] = page_table[i].bytes_used;
+}
+
+/* Find the object in dynamic space enclosing POINTER like
+ * search_dynamic_space(), but from the object start bits rather than
+ * by walking the region, for the collector's use only. */
+static lispobj *
+gc_search_dynamic_space(void *pointer)
+{
+    page_index_t page_index = find_page_index(pointer);
+    lispobj *start, thing;
+    uword_t bit, low_bit, word;
+    sword_t i, count;
+
+    if ((page_index == -1) || page_free_p(page_index)
+        || (((uword_t)pointer & (GENCGC_CARD_BYTES - 1))
+            >= page_table[page_index].bytes_used))
+        return NULL;
+    start = (lispobj *)page_region_start(page_index);
+    if (!page_no_region_p(page_index))
+        return gc_search_space(start,
+                               (((lispobj *)pointer)+2)-start,
+                               (lispobj *)pointer);
+    if (!page_table[page_index].large_object) {
+        /* Back from POINTER to the nearest start, which is at worst
+         * the start of the region. */
+        fill_object_starts(page_index);
+        bit = object_start_bit(pointer);
+        low_bit = object_start_bit(start);
+        i = bit / N_WORD_BITS;
+        word = object_start_bits[i]
+            & (~(uword_t)0 >> (N_WORD_BITS - 1 - bit % N_WORD_BITS));
+        while ((word == 0) && ((uword_t)i > low_bit / N_WORD_BITS))
+            word = object_start_bits[--i];
+        if (word) {
+            bit = i * N_WORD_BITS + highest_bit(word);
+            if (bit > low_bit)
+                start = (lispobj *)(DYNAMIC_SPACE_START
+                                    + bit * 2 * N_WORD_BYTES);
+        }
+    }
+    thing = *start;
+    if (is_lisp_pointer(thing) || is_lisp_immediate(thing))
+        count = 2;
+    else
+        count = (sizetab[widetag_of(thing)])(start);
+    return ((lispobj *)pointer < start + count) ? start : NULL;
+}
+
 /* a faster version for searching the dynamic space. This will work even
  * if the object is in a current allocation region. */
 lispobj *
@@ -2044,7 +2452,7 @@ possibly_valid_dynamic_space_pointer(lispobj *pointer)
     lispobj *start_addr;
 
     /* Find the object start address. */
-    if ((start_addr = search_dynamic_space(pointer)) == NULL) {
+    if ((start_addr = gc_search_dynamic_space(pointer)) == NULL) {
         return 0;
     }
 
@@ -2203,6 +2611,8 @@ maybe_adjust_large_object(lispobj *where)
         old_bytes_used = page_table[next_page].bytes_used;
         page_table[next_page].allocated = FREE_PAGE_FLAG;
         page_table[next_page].bytes_used = 0;
+        page_wp_faults[next_page] = 0;
+        clear_object_starts(next_page);
         bytes_freed += old_bytes_used;
         next_page++;
     }
@@ -2219,6 +2629,80 @@ maybe_adjust_large_object(lispobj *where)
     return;
 }
 
+/* Find the pages of the contiguous block [FIRST_PAGE, LAST_PAGE] which
+ * must be pinned to keep the object containing ADDR in place. A block
+ * can only be cut where an object starts exactly on a page boundary,
+ * so the range is widened over any object straddling its ends. The
+ * parts of the block outside the range are made into blocks of their
+ * own, so that they can be evacuated as usual. */
+static void
+narrow_pinned_pages(page_index_t first_page, page_index_t last_page,
+                    void *addr,
+                    page_index_t *pin_first, page_index_t *pin_last)
+{
+    lispobj *object = gc_search_dynamic_space(addr);
+    lispobj *object_end;
+    page_index_t lo, hi, i;
+
+    if (object == NULL) {
+        /* Not inside any object: play it safe and pin it all. */
+        *pin_first = first_page;
+        *pin_last = last_page;
+        return;
+    }
+    object_end = object + object_size_words(object);
+    fill_object_starts(last_page);
+
+    /* Back to the last page boundary at which an object starts, and
+     * on to the first one after the object. Missing start bits only
+     * make the range wider. */
+    for (lo = find_page_index(object); lo > first_page; lo--)
+        if (object_start_p(page_address(lo)))
+            break;
+    hi = last_page;
+    for (i = find_page_index(object_end - 1) + 1; i <= last_page; i++)
+        if (object_start_p(page_address(i))) {
+            hi = i - 1;
+            break;
+        }
+
+    if (lo > first_page)
+        for (i = lo; i <= last_page; i++)
+            page_table[i].region_start_offset = npage_bytes(i - lo);
+    if (hi < last_page)
+        for (i = hi + 1; i <= last_page; i++)
+            page_table[i].region_start_offset = npage_bytes(i - (hi + 1));
+
+    *pin_first = lo;
+    *pin_last = hi;
+}
+
+/* Mark the pages FIRST to LAST of from_space as dont_move. */
+static void
+pin_pages(page_index_t first, page_index_t last)
+{
+    page_index_t i;
+
+    for (i = first; i <= last; i++) {
+        /* Mark the page static. */
+        page_table[i].dont_move = 1;
+
+        /* Move the page to the new_space. XX I'd rather not do this
+         * but the GC logic is not quite able to copy with the static
+         * pages remaining in the from space. This also requires the
+         * generation bytes_allocated counters be updated. */
+        page_table[i].gen = new_space;
+        generations[new_space].bytes_allocated += page_table[i].bytes_used;
+        generations[from_space].bytes_allocated -= page_table[i].bytes_used;
+
+        /* It is essential that the pages are not write protected as
+         * they may have pointers into the old-space which need
+         * scavenging. They shouldn't be write protected at this
+         * stage. */
+        gc_assert(!page_table[i].write_protected);
+    }
+}
+
 /* Take a possible pointer to a Lisp object and mark its page in the
  * page_table so that it will not be relocated during a GC.
  *
@@ -2236,8 +2720,8 @@ static void
 preserve_pointer(void *addr)
 {
     page_index_t addr_page_index = find_page_index(addr);
-    page_index_t first_page;
-    page_index_t i;
+    page_index_t first_page, last_page;
+    page_index_t pin_first, pin_last;
     unsigned int region_allocation;
 
     /* quick check 1: Address is quite likely to have been invalid. */
@@ -2319,107 +2803,522 @@ preserve_pointer(void *addr)
         region_allocation = page_table[first_page].allocated;
     }
 
-    /* Now work forward until the end of this contiguous area is found,
-     * marking all pages as dont_move. */
-    for (i = first_page; ;i++) {
-        gc_assert(page_table[i].allocated == region_allocation);
-
-        /* Mark the page static. */
-        page_table[i].dont_move = 1;
-
-        /* Move the page to the new_space. XX I'd rather not do this
-         * but the GC logic is not quite able to copy with the static
-         * pages remaining in the from space. This also requires the
-         * generation bytes_allocated counters be updated. */
-        page_table[i].gen = new_space;
-        generations[new_space].bytes_allocated += page_table[i].bytes_used;
-        generations[from_space].bytes_allocated -= page_table[i].bytes_used;
-
-        /* It is essential that the pages are not write protected as
-         * they may have pointers into the old-space which need
-         * scavenging. They shouldn't be write protected at this
-         * stage. */
-        gc_assert(!page_table[i].write_protected);
+    /* Now work forward until the end of this contiguous area is found. */
+    for (last_page = first_page; ; last_page++) {
+        gc_assert(page_table[last_page].allocated == region_allocation);
 
         /* Check whether this is the last page in this contiguous block.. */
-        if ((page_table[i].bytes_used < GENCGC_CARD_BYTES)
+        if ((page_table[last_page].bytes_used < GENCGC_CARD_BYTES)
             /* ..or it is CARD_BYTES and is the last in the block */
-            || page_free_p(i+1)
-            || (page_table[i+1].bytes_used == 0) /* next page free */
-            || (page_table[i+1].gen != from_space) /* diff. gen */
-            || (page_table[i+1].region_start_offset == 0))
+            || page_free_p(last_page+1)
+            || (page_table[last_page+1].bytes_used == 0) /* next page free */
+            || (page_table[last_page+1].gen != from_space) /* diff. gen */
+            || (page_table[last_page+1].region_start_offset == 0))
             break;
     }
 
+    /* A large object has to stay in one piece, but a block of small
+     * objects need only keep the pages around the one referred to. */
+    if (page_table[first_page].large_object || (first_page == last_page)) {
+        pin_first = first_page;
+        pin_last = last_page;
+    } else {
+        narrow_pinned_pages(first_page, last_page, addr, &pin_first, &pin_last);
+    }
+
+    pin_pages(pin_first, pin_last);
+
     /* Check that the page is now static. */
     gc_assert(page_table[addr_page_index].dont_move != 0);
 }
-
-/* If the given page is not write-protected, then scan it for pointers
- * to younger generations or the top temp. generation, if no
- * suspicious pointers are found then the page is write-protected.
- *
- * Care is taken to check for pointers to the current gc_alloc()
- * region if it is a younger generation or the temp. generation. This
- * frees the caller from doing a gc_alloc_update_page_tables(). Actually
- * the gc_alloc_generation does not need to be checked as this is only
- * called from scavenge_generation() when the gc_alloc generation is
- * younger, so it just checks if there is a pointer to the current
- * region.
- *
- * We return 1 if the page was write-protected, else 0. */
-static int
-update_page_write_prot(page_index_t page)
-{
-    generation_index_t gen = page_table[page].gen;
-    intptr_t j;
-    int wp_it = 1;
-    void **page_addr = (void **)page_address(page);
-    intptr_t num_words = page_table[page].bytes_used / N_WORD_BYTES;
-
-    /* Shouldn't be a free page. */
-    gc_assert(page_allocated_p(page));
-    gc_assert(page_table[page].bytes_used != 0);
-
-    /* Skip if it's already write-protected, pinned, or unboxed */
-    if (page_table[page].write_protected
-        /* FIXME: What's the reason for not write-protecting pinned pages? */
-        || page_table[page].dont_move
-        || page_unboxed_p(page))
-        return (0);
 
-    /* Scan the page for pointers to younger generations or the
-     * top temp. generation. */
+/* where the next collection that can't evacuate all of its
+ * from_space starts choosing blocks, so that each gets its turn */
+static page_index_t evacuation_cursor = 0;
 
-    for (j = 0; j < num_words; j++) {
-        void *ptr = *(page_addr+j);
-        page_index_t index = find_page_index(ptr);
+/* Evacuate the from_space blocks which start in [FROM, TO) while
+ * they fit in BUDGET bytes, and pin the rest. Blocks are taken whole,
+ * since objects may span their pages. Returns what is left of BUDGET. */
+static os_vm_size_t
+evacuate_or_pin_blocks(page_index_t from, page_index_t to, os_vm_size_t budget)
+{
+    page_index_t first, last, i;
+    os_vm_size_t bytes;
+
+    for (first = from; first < to; first = last + 1) {
+        last = first;
+        if (page_free_p(first)
+            || (page_table[first].gen != from_space)
+            || page_table[first].large_object
+            || (page_table[first].region_start_offset != 0))
+            continue;
+        while ((page_table[last].bytes_used == GENCGC_CARD_BYTES)
+               && (last + 1 < last_free_page)
+               && !page_free_p(last + 1)
+               && (page_table[last+1].gen == from_space)
+               && (page_table[last+1].region_start_offset != 0))
+            last++;
+        bytes = 0;
+        for (i = first; i <= last; i++)
+            bytes += page_table[i].bytes_used;
+        if (bytes <= budget) {
+            budget -= bytes;
+            /* The next collection starts after the last evacuated. */
+            evacuation_cursor = last + 1;
+        } else {
+            budget = 0;
+            pin_pages(first, last);
+        }
+    }
+    return budget;
+}
 
-        /* Check that it's in the dynamic space */
-        if (index != -1)
-            if (/* Does it point to a younger or the temp. generation? */
-                (page_allocated_p(index)
-                 && (page_table[index].bytes_used != 0)
-                 && ((page_table[index].gen < gen)
-                     || (page_table[index].gen == SCRATCH_GENERATION)))
+/* Copying from_space needs as much free space as it has live data. If
+ * that might not be there, or the generation has an evacuation_limit,
+ * evacuate only as many blocks as fit and pin the rest in place as if
+ * they had been conservatively referenced. Garbage on the pinned pages
+ * and whatever it refers to survive until a later collection gets
+ * round to them, which is the price of the smaller headroom. Large
+ * objects are never copied, and don't count. */
+static void
+limit_evacuation(void)
+{
+    os_vm_size_t budget, movable = 0, free_bytes;
+    os_vm_size_t limit = generations[from_space].evacuation_limit;
+    page_index_t i, free_pages = 0, start;
 
-                /* Or does it point within a current gc_alloc() region? */
-                || ((boxed_region.start_addr <= ptr)
-                    && (ptr <= boxed_region.free_pointer))
-                || ((unboxed_region.start_addr <= ptr)
-                    && (ptr <= unboxed_region.free_pointer))) {
-                wp_it = 0;
-                break;
-            }
+    for (i = 0; i < page_table_pages; i++) {
+        if (page_free_p(i))
+            free_pages++;
+        else if ((page_table[i].gen == from_space)
+                 && !page_table[i].large_object)
+            movable += page_table[i].bytes_used;
     }
+    /* Leave room for the ends of the regions copied into. */
+    free_bytes = npage_bytes(free_pages);
+    budget = free_bytes - free_bytes/8;
+    if (limit && (limit < budget))
+        budget = limit;
+    if (movable <= budget)
+        return;
 
-    if (wp_it == 1) {
-        /* Write-protect the page. */
-        /*FSHOW((stderr, "/write-protecting page %d gen %d\n", page, gen));*/
+    if (gencgc_verbose)
+        FSHOW((stderr,
+               "/evacuating at most %lu of %lu bytes of generation %d\n",
+               (unsigned long)budget, (unsigned long)movable, from_space));
+
+    /* Go round once, from the cursor to the end and then from the
+     * bottom. A block straddling the cursor is seen on the way back. */
+    start = (evacuation_cursor < last_free_page) ? evacuation_cursor : 0;
+    budget = evacuate_or_pin_blocks(start, last_free_page, budget);
+    evacuate_or_pin_blocks(0, start, budget);
+}
 
-        os_protect((void *)page_addr,
-                   GENCGC_CARD_BYTES,
-                   OS_VM_PROT_READ|OS_VM_PROT_EXECUTE);
+#if defined(LISP_FEATURE_X86_64) && defined(LISP_FEATURE_SB_GC_SAFEPOINT)
+
+/*
+ * precise stack scanning
+ *
+ * A thread stopped for GC is either in foreign code or at a safepoint
+ * trap, and every Lisp frame above the innermost one is suspended at
+ * a call site. The compiler records, for each call site, which of the
+ * caller's slots hold live descriptors (COMPUTE-STACK-MAPS), so the
+ * collector can follow the frame pointer chain from the frame pointer
+ * saved with the stack top and scavenge those slots like any other
+ * root. Everything else -- the innermost frame, whatever lies between
+ * the fixed parts of two frames (values, &MORE args, dynamic-extent
+ * objects), foreign frames and frames of code without a map -- is
+ * still preserved conservatively.
+ */
+
+/* descriptor slots found while pinning, scavenged once pinning is
+ * over so that no object is moved while pages are still being pinned */
+static lispobj **precise_stack_roots;
+static uword_t precise_stack_roots_count, precise_stack_roots_size;
+
+/* Return the stack map entry for the return address RA, storing the
+ * frame size and bitmap width of its component, or NULL if RA is not
+ * a call site in code with a map. */
+static uint32_t *
+stack_map_entry(lispobj ra, uword_t *frame_size, uword_t *nwords)
+{
+    lispobj *code_obj = component_ptr_from_pc((lispobj *)ra);
+    struct code *code = (struct code *)code_obj;
+    struct compiled_debug_info *di;
+    struct vector *map;
+    uint32_t *data;
+    uword_t offset, stride, low, high;
+
+    if (!code_obj || lowtag_of(code->debug_info) != INSTANCE_POINTER_LOWTAG)
+        return NULL;
+    di = (struct compiled_debug_info *)native_pointer(code->debug_info);
+    if (lowtag_of(di->stack_maps) != OTHER_POINTER_LOWTAG)
+        return NULL;
+    map = (struct vector *)native_pointer(di->stack_maps);
+    data = (uint32_t *)map->data;
+    *frame_size = data[0];
+    *nwords = data[1];
+    stride = 1 + 2 * *nwords;
+    offset = ra - (lispobj)code_obj - sizeof(lispobj) * HeaderValue(code->header);
+
+    /* The entries are sorted by PC. */
+    low = 0;
+    high = (fixnum_value(map->length) - 2) / stride;
+    while (low < high) {
+        uword_t mid = (low + high) / 2;
+        uint32_t *entry = data + 2 + mid * stride;
+        if (entry[0] == offset)
+            return entry;
+        if (entry[0] < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+/* A slot known to hold a descriptor is left for
+ * scavenge_precise_stack_roots() if it points to the start of an
+ * object which may move. Anything else it could be -- a stale value
+ * in a slot not yet written, or something on a code page -- is
+ * treated like any other word of the stack. */
+static void
+note_precise_stack_root(lispobj *slot)
+{
+    lispobj obj = *slot;
+    page_index_t page = find_page_index((void *)obj);
+    lispobj *start;
+
+    if (!is_lisp_pointer(obj) || page == -1 || page_free_p(page)
+        || page_table[page].gen != from_space
+        || page_table[page].dont_move
+        || code_page_p(page)
+        || (start = gc_search_dynamic_space((void *)obj)) != native_pointer(obj)
+        || !looks_like_valid_lisp_pointer_p(obj, start)) {
+        preserve_pointer((void *)obj);
+        return;
+    }
+    if (precise_stack_roots_count == precise_stack_roots_size) {
+        precise_stack_roots_size =
+            precise_stack_roots_size ? 2 * precise_stack_roots_size : 1024;
+        precise_stack_roots =
+            realloc(precise_stack_roots,
+                    precise_stack_roots_size * sizeof(lispobj *));
+        if (!precise_stack_roots)
+            lose("can't grow the table of precise stack roots\n");
+    }
+    precise_stack_roots[precise_stack_roots_count++] = slot;
+}
+
+static void
+preserve_stack_range(void **start, void **end)
+{
+    for (; start < end; start++)
+        preserve_pointer(*start);
+}
+
+/* Pin or note the roots on the stack of TH from LOW up. FP is the
+ * frame pointer saved with the stack top, or 0 if there is none to
+ * walk from. */
+static void
+preserve_thread_stack(struct thread *th, void **low, lispobj *fp)
+{
+    void **end = (void **)th->control_stack_end;
+    void **scanned = low;
+    lispobj *frame = fp;
+
+    if (gencgc_precise_stack && frame
+        && ((uword_t)frame & (N_WORD_BYTES - 1)) == 0
+        && (void **)frame >= low && (void **)(frame + 2) <= end) {
+        /* The innermost frame may be anywhere in its body. */
+        preserve_stack_range(low, (void **)(frame + 2));
+        scanned = (void **)(frame + 2);
+        for (;;) {
+            lispobj *next = (lispobj *)frame[0];
+            uword_t size, nwords, k;
+            uint32_t *entry;
+            lispobj *slots;
+
+            if (next <= frame || (void **)(next + 2) > end
+                || ((uword_t)next & (N_WORD_BYTES - 1)))
+                break;
+            entry = stack_map_entry(frame[1], &size, &nwords);
+            if (!entry)
+                break;
+            /* Slot K of a frame is K-1 words below its frame pointer,
+             * slots 0 and 1 being the saved frame pointer and return
+             * address above it. */
+            slots = next - (size - 2);
+            if ((void **)slots < scanned)
+                break;
+            preserve_stack_range(scanned, (void **)slots);
+            for (k = 2; k < size; k++) {
+                lispobj *slot = next - (k - 1);
+                if (entry[1 + k / 32] & (1U << (k % 32)))
+                    note_precise_stack_root(slot);
+                else if (entry[1 + nwords + k / 32] & (1U << (k % 32)))
+                    preserve_pointer((void *)*slot);
+            }
+            preserve_stack_range((void **)next, (void **)(next + 2));
+            scanned = (void **)(next + 2);
+            frame = next;
+        }
+    }
+    preserve_stack_range(scanned, end);
+}
+
+static void
+scavenge_precise_stack_roots(void)
+{
+    uword_t i;
+
+    for (i = 0; i < precise_stack_roots_count; i++)
+        scavenge(precise_stack_roots[i], 1);
+    precise_stack_roots_count = 0;
+}
+
+#endif
+
+/*
+ * parallel GC work
+ *
+ * Phases of a collection which only read the heap and write disjoint
+ * entries of page_table[] can be split across a pool of helper
+ * threads. Pages are handed out in chunks from a shared cursor, and
+ * the collecting thread works alongside the helpers until the range
+ * is exhausted. Transporting objects remains single-threaded, since
+ * forwarding pointers are not installed atomically.
+ */
+
+/* how many pages a thread claims at a time */
+#define GC_WORK_CHUNK_PAGES 64
+
+typedef void (*gc_work_fun)(page_index_t first, page_index_t end, void *arg);
+
+struct gc_work {
+    gc_work_fun fun;
+    void *arg;
+    page_index_t next;
+    page_index_t end;
+};
+
+static void
+gc_do_work(struct gc_work *work)
+{
+    for (;;) {
+        page_index_t first =
+            __sync_fetch_and_add(&work->next, GC_WORK_CHUNK_PAGES);
+        if (first >= work->end)
+            return;
+        work->fun(first,
+                  (work->end - first > GC_WORK_CHUNK_PAGES)
+                  ? first + GC_WORK_CHUNK_PAGES : work->end,
+                  work->arg);
+    }
+}
+
+#ifdef LISP_FEATURE_SB_THREAD
+static pthread_mutex_t gc_work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_work_start;
+static pthread_cond_t gc_work_done;
+static struct gc_work *gc_current_work = NULL;
+static uword_t gc_work_generation = 0;
+static int gc_workers_started = 0;
+static int gc_workers_busy = 0;
+
+static void *
+gc_worker_main(void *ignored)
+{
+    uword_t seen = 0;
+
+    thread_mutex_lock(&gc_work_lock);
+    for (;;) {
+        while (gc_work_generation == seen)
+            pthread_cond_wait(&gc_work_start, &gc_work_lock);
+        seen = gc_work_generation;
+        thread_mutex_unlock(&gc_work_lock);
+
+        gc_do_work(gc_current_work);
+
+        thread_mutex_lock(&gc_work_lock);
+        if (--gc_workers_busy == 0)
+            pthread_cond_signal(&gc_work_done);
+    }
+    return NULL;
+}
+
+/* Start the helper threads the first time they are needed. They never
+ * run Lisp code, so they are created with all signals blocked and are
+ * invisible to stop-for-GC. Returns the number of running helpers. */
+static int
+gc_start_workers(void)
+{
+    static boolean tried = 0;
+    sigset_t all, old;
+    pthread_t tid;
+    int i;
+
+    if (tried)
+        return gc_workers_started;
+    tried = 1;
+
+    pthread_cond_init(&gc_work_start, NULL);
+    pthread_cond_init(&gc_work_done, NULL);
+    sigfillset(&all);
+    thread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 1; i < gencgc_gc_threads; i++) {
+        if (pthread_create(&tid, NULL, gc_worker_main, NULL)) {
+            FSHOW((stderr, "/could not start GC helper thread %d\n", i));
+            break;
+        }
+        pthread_detach(tid);
+        gc_workers_started++;
+    }
+    thread_sigmask(SIG_SETMASK, &old, 0);
+    return gc_workers_started;
+}
+#endif
+
+/* Call FUN on consecutive chunks of the page range [START, END),
+ * using the helper threads if there are any. FUN must be safe to run
+ * concurrently on disjoint ranges. */
+static void
+gc_run_parallel(gc_work_fun fun, void *arg,
+                page_index_t start, page_index_t end)
+{
+    struct gc_work work;
+
+    work.fun = fun;
+    work.arg = arg;
+    work.next = start;
+    work.end = end;
+#ifdef LISP_FEATURE_SB_THREAD
+    if ((gencgc_gc_threads > 1)
+        && (end - start > GC_WORK_CHUNK_PAGES)
+        && gc_start_workers()) {
+        thread_mutex_lock(&gc_work_lock);
+        gc_current_work = &work;
+        gc_workers_busy = gc_workers_started;
+        gc_work_generation++;
+        pthread_cond_broadcast(&gc_work_start);
+        thread_mutex_unlock(&gc_work_lock);
+
+        gc_do_work(&work);
+
+        thread_mutex_lock(&gc_work_lock);
+        while (gc_workers_busy != 0)
+            pthread_cond_wait(&gc_work_done, &gc_work_lock);
+        gc_current_work = NULL;
+        thread_mutex_unlock(&gc_work_lock);
+        return;
+    }
+#endif
+    gc_do_work(&work);
+}
+
+/* If the given page is not write-protected, then scan it for pointers
+ * to younger generations or the top temp. generation, if no
+ * suspicious pointers are found then the page is write-protected.
+ *
+ * Care is taken to check for pointers to the current gc_alloc()
+ * region if it is a younger generation or the temp. generation. This
+ * frees the caller from doing a gc_alloc_update_page_tables(). Actually
+ * the gc_alloc_generation does not need to be checked as this is only
+ * called from scavenge_generation() when the gc_alloc generation is
+ * younger, so it just checks if there is a pointer to the current
+ * region.
+ *
+ * Protection is applied through BATCH, so that runs of adjacent pages
+ * cost a single os_protect() call.
+ *
+ * We return 1 if the page was write-protected, else 0. */
+
+struct wp_batch {
+    page_index_t first, end;
+};
+
+static void
+wp_batch_flush(struct wp_batch *batch)
+{
+    if (batch->end > batch->first)
+        os_protect(page_address(batch->first),
+                   npage_bytes(batch->end - batch->first),
+                   OS_VM_PROT_READ|OS_VM_PROT_EXECUTE);
+    batch->first = batch->end;
+}
+
+static inline void
+wp_batch_add(struct wp_batch *batch, page_index_t page)
+{
+    if (page != batch->end) {
+        wp_batch_flush(batch);
+        batch->first = page;
+    }
+    batch->end = page + 1;
+}
+
+static int
+update_page_write_prot(page_index_t page, struct wp_batch *batch)
+{
+    generation_index_t gen = page_table[page].gen;
+    intptr_t j;
+    int wp_it = 1;
+    void **page_addr = (void **)page_address(page);
+    intptr_t num_words = page_table[page].bytes_used / N_WORD_BYTES;
+
+    /* Shouldn't be a free page. */
+    gc_assert(page_allocated_p(page));
+    gc_assert(page_table[page].bytes_used != 0);
+
+    /* Let the fault history cool down on every rescan, so that a page
+     * only stays hot while it keeps faulting more often than that. */
+    if (page_wp_faults[page] != 0)
+        page_wp_faults[page]--;
+
+    /* Skip if it's already write-protected, pinned, or unboxed */
+    if (page_table[page].write_protected
+        /* FIXME: What's the reason for not write-protecting pinned pages? */
+        || page_table[page].dont_move
+        || page_unboxed_p(page))
+        return (0);
+
+    /* Scan the page for pointers to younger generations or the
+     * top temp. generation. */
+
+    for (j = 0; j < num_words; j++) {
+        void *ptr = *(page_addr+j);
+        page_index_t index = find_page_index(ptr);
+
+        /* Check that it's in the dynamic space */
+        if (index != -1)
+            if (/* Does it point to a younger or the temp. generation? */
+                (page_allocated_p(index)
+                 && (page_table[index].bytes_used != 0)
+                 && ((page_table[index].gen < gen)
+                     || (page_table[index].gen == SCRATCH_GENERATION)))
+
+                /* Or does it point within a current gc_alloc() region? */
+                || ((boxed_region.start_addr <= ptr)
+                    && (ptr <= boxed_region.free_pointer))
+                || ((unboxed_region.start_addr <= ptr)
+                    && (ptr <= unboxed_region.free_pointer))
+                || ((code_region.start_addr <= ptr)
+                    && (ptr <= code_region.free_pointer))) {
+                wp_it = 0;
+                break;
+            }
+    }
+
+    if ((wp_it == 1) && page_hot_p(page)) {
+        /* Still being written to: leave it unprotected. */
+        wp_it = 0;
+    }
+
+    if (wp_it == 1) {
+        /* Write-protect the page. */
+        /*FSHOW((stderr, "/write-protecting page %d gen %d\n", page, gen));*/
+
+        wp_batch_add(batch, page);
 
         /* Note the page as protected in the page tables. */
         page_table[page].write_protected = 1;
@@ -2428,6 +3327,81 @@ update_page_write_prot(page_index_t page)
     return (wp_it);
 }
 
+/* Scavenge the parts of the contiguous boxed block [FIRST_PAGE,
+ * LAST_PAGE] which may have been written to since it was last
+ * write-protected. A large simple vector is scanned page by page, as
+ * each word of it is a descriptor; otherwise, whole objects are
+ * scanned if they overlap any unprotected page. */
+static void
+scavenge_unprotected_pages(page_index_t first_page, page_index_t last_page)
+{
+    lispobj *where = (lispobj *)page_address(first_page);
+    lispobj *end = (lispobj *)(page_address(last_page)
+                               + page_table[last_page].bytes_used);
+    lispobj *run = NULL;
+    page_index_t i;
+
+    if (page_table[first_page].large_object
+        && (widetag_of(*where) == SIMPLE_VECTOR_WIDETAG)
+        && (HeaderValue(*where) == subtype_VectorNormal)) {
+        for (i = first_page; i <= last_page; i++)
+            if (!page_table[i].write_protected)
+                scavenge((lispobj *)page_address(i),
+                         page_table[i].bytes_used / N_WORD_BYTES);
+        return;
+    }
+
+    while (where < end) {
+        lispobj *next = where + object_size_words(where);
+        page_index_t last = find_page_index(next - 1);
+        boolean dirty = 0;
+
+        for (i = find_page_index(where); i <= last; i++)
+            if (!page_table[i].write_protected) {
+                dirty = 1;
+                break;
+            }
+        if (dirty) {
+            if (!run)
+                run = where;
+        } else if (run) {
+            scavenge(run, where - run);
+            run = NULL;
+        }
+        where = next;
+    }
+    if (run)
+        scavenge(run, end - run);
+}
+
+struct write_prot_scan {
+    generation_index_t from, to;
+    page_index_t num_wp;
+};
+
+/* gc_run_parallel() worker: update the write protection of the boxed
+ * pages in [FIRST, END) which scavenge_generations() looked at. */
+static void
+update_write_prot_range(page_index_t first, page_index_t end, void *arg)
+{
+    struct write_prot_scan *scan = arg;
+    struct wp_batch batch = { 0, 0 };
+    page_index_t i, num_wp = 0;
+
+    for (i = first; i < end; i++) {
+        generation_index_t generation = page_table[i].gen;
+        if (page_boxed_p(i)
+            && (page_table[i].bytes_used != 0)
+            && (generation != new_space)
+            && (generation >= scan->from)
+            && (generation <= scan->to))
+            num_wp += update_page_write_prot(i, &batch);
+    }
+    wp_batch_flush(&batch);
+    if (num_wp != 0)
+        __sync_fetch_and_add(&scan->num_wp, num_wp);
+}
+
 /* Scavenge all generations from FROM to TO, inclusive, except for
  * new_space which needs special handling, as new objects may be
  * added which are not checked here - use scavenge_newspace generation.
@@ -2462,6 +3436,7 @@ scavenge_generations(generation_index_t from, generation_index_t to)
 {
     page_index_t i;
     page_index_t num_wp = 0;
+    struct wp_batch batch = { 0, 0 };
 
 #define SC_GEN_CK 0
 #if SC_GEN_CK
@@ -2478,7 +3453,7 @@ scavenge_generations(generation_index_t from, generation_index_t to)
             && (generation >= from)
             && (generation <= to)) {
             page_index_t last_page,j;
-            int write_protected=1;
+            int write_protected=1, any_write_protected=0;
 
             /* This should be the start of a region */
             gc_assert(page_table[i].region_start_offset == 0);
@@ -2487,6 +3462,8 @@ scavenge_generations(generation_index_t from, generation_index_t to)
             for (last_page = i; ; last_page++) {
                 write_protected =
                     write_protected && page_table[last_page].write_protected;
+                any_write_protected =
+                    any_write_protected || page_table[last_page].write_protected;
                 if ((page_table[last_page].bytes_used < GENCGC_CARD_BYTES)
                     /* Or it is CARD_BYTES and is the last in the block */
                     || (!page_boxed_p(last_page+1))
@@ -2496,27 +3473,47 @@ scavenge_generations(generation_index_t from, generation_index_t to)
                     break;
             }
             if (!write_protected) {
-                scavenge(page_address(i),
-                         ((uword_t)(page_table[last_page].bytes_used
-                                          + npage_bytes(last_page-i)))
-                         /N_WORD_BYTES);
-
-                /* Now scan the pages and write protect those that
-                 * don't have pointers to younger generations. */
-                if (enable_page_protection) {
-                    for (j = i; j <= last_page; j++) {
-                        num_wp += update_page_write_prot(j);
-                    }
-                }
-                if ((gencgc_verbose > 1) && (num_wp != 0)) {
-                    FSHOW((stderr,
-                           "/write protected %d pages within generation %d\n",
-                           num_wp, generation));
+                if (any_write_protected)
+                    scavenge_unprotected_pages(i, last_page);
+                else
+                    scavenge(page_address(i),
+                             ((uword_t)(page_table[last_page].bytes_used
+                                        + npage_bytes(last_page-i)))
+                             /N_WORD_BYTES);
+            }
+
+            /* Now scan the pages and write protect those that don't
+             * have pointers to younger generations. Pages which are
+             * already protected are looked at too, so that their
+             * fault history cools down. With helper threads this is
+             * done for all the generations at once, below. */
+            if (enable_page_protection && (gencgc_gc_threads <= 1)) {
+                for (j = i; j <= last_page; j++) {
+                    num_wp += update_page_write_prot(j, &batch);
                 }
             }
+            if ((gencgc_verbose > 1) && (num_wp != 0)) {
+                FSHOW((stderr,
+                       "/write protected %d pages within generation %d\n",
+                       num_wp, generation));
+            }
             i = last_page;
         }
     }
+    wp_batch_flush(&batch);
+
+    if (enable_page_protection && (gencgc_gc_threads > 1)) {
+        struct write_prot_scan scan;
+        scan.from = from;
+        scan.to = to;
+        scan.num_wp = 0;
+        gc_run_parallel(update_write_prot_range, &scan, 0, last_free_page);
+        if ((gencgc_verbose > 1) && (scan.num_wp != 0)) {
+            FSHOW((stderr,
+                   "/write protected %d pages within generations %d-%d\n",
+                   scan.num_wp, from, to));
+        }
+    }
 
 #if SC_GEN_CK
     /* Check that none of the write_protected pages in this generation
@@ -2563,6 +3560,296 @@ scavenge_generations(generation_index_t from, generation_index_t to)
 static struct new_area new_areas_1[NUM_NEW_AREAS];
 static struct new_area new_areas_2[NUM_NEW_AREAS];
 
+static inline boolean
+code_mark_bit_p(uword_t bit)
+{
+    return (code_mark_bits[bit / N_WORD_BITS] >> (bit % N_WORD_BITS)) & 1;
+}
+
+static inline void
+set_code_mark_bit(uword_t bit)
+{
+    code_mark_bits[bit / N_WORD_BITS] |= (uword_t)1 << (bit % N_WORD_BITS);
+}
+
+static inline boolean
+code_stays_p(page_index_t page)
+{
+    return !gencgc_move_code && (page_table[page].allocated == CODE_PAGE_FLAG);
+}
+
+/* Called by trans_code() for CODE, which is in from_space. If CODE is
+ * not to be moved, mark it to be scavenged where it is and return
+ * true. */
+boolean
+gc_keep_code_p(lispobj *code)
+{
+    page_index_t page = find_page_index(code);
+    uword_t bit = object_start_bit(code);
+
+    if (!code_stays_p(page))
+        return 0;
+    if (!code_mark_bit_p(bit)) {
+        set_code_mark_bit(bit);
+        gc_object_reached(code);
+        if (page < code_scan_start)
+            code_scan_start = page;
+        if (page >= code_scan_end)
+            code_scan_end = page + 1;
+    }
+    return 1;
+}
+
+/* Has OBJ, a pointer to from_space, been reached as (or inside) a
+ * code object which stays in place? */
+boolean
+gc_code_marked_p(lispobj obj)
+{
+    lispobj *where = native_pointer(obj);
+    page_index_t page = find_page_index(where);
+
+    if ((page == -1) || !code_stays_p(page))
+        return 0;
+    switch (widetag_of(*where)) {
+    case SIMPLE_FUN_HEADER_WIDETAG:
+    case RETURN_PC_HEADER_WIDETAG:
+        where -= HeaderValue(*where);
+        break;
+    }
+    return code_mark_bit_p(object_start_bit(where));
+}
+
+/* Scavenge the code objects which have been reached but not yet
+ * scavenged, and whatever that reaches in turn. */
+static void
+scavenge_marked_code(void)
+{
+    while (code_scan_start < code_scan_end) {
+        uword_t bit = object_start_bit(page_address(code_scan_start));
+        uword_t end = object_start_bit(page_address(code_scan_end));
+
+        /* Anything reached from here on is noted afresh. */
+        code_scan_start = page_table_pages;
+        code_scan_end = 0;
+        for (; bit < end; bit++) {
+            if (((bit % N_WORD_BITS) == 0)
+                && (code_mark_bits[bit / N_WORD_BITS] == 0)) {
+                bit += N_WORD_BITS - 1;
+                continue;
+            }
+            if (!code_mark_bit_p(bit))
+                continue;
+            if (!code_mark_bit_p(bit + 1)) {
+                lispobj *where = (lispobj *)(DYNAMIC_SPACE_START
+                                             + bit * 2 * N_WORD_BYTES);
+                gc_assert(widetag_of(*where) == CODE_HEADER_WIDETAG);
+                set_code_mark_bit(bit + 1);
+                scavenge(where, object_size_words(where));
+            }
+            bit++;
+        }
+    }
+}
+
+static inline int
+code_hole_bin(sword_t nwords)
+{
+    int bin = highest_bit(nwords) - 2;
+    return (bin < CODE_HOLE_BINS) ? bin : CODE_HOLE_BINS - 1;
+}
+
+/* Turn the NWORDS at WHERE, which hold nothing live, into unboxed
+ * filler, and list it as a hole if it is big enough for code. */
+static void
+add_code_hole(lispobj *where, sword_t nwords)
+{
+    int bin;
+
+    where[0] = SIMPLE_ARRAY_WORD_WIDETAG;
+    where[1] = make_fixnum(nwords - 2);
+    /* Every code object is at least four words long. */
+    if (nwords < 4)
+        return;
+    bin = code_hole_bin(nwords);
+    where[2] = (lispobj)code_holes[bin];
+    code_holes[bin] = where;
+}
+
+/* Drop the holes on pages of from_space from the bins: the blocks
+ * which survive are about to be swept again, and the rest freed. */
+static void
+forget_from_space_code_holes(void)
+{
+    int bin;
+    lispobj **prev;
+
+    for (bin = 0; bin < CODE_HOLE_BINS; bin++)
+        for (prev = &code_holes[bin]; *prev; ) {
+            lispobj *hole = *prev;
+            if (page_table[find_page_index(hole)].gen == from_space)
+                *prev = (lispobj *)hole[2];
+            else
+                prev = (lispobj **)&hole[2];
+        }
+}
+
+/* Take NWORDS for a new code object from the first hole that fits,
+ * looking in the bin for NWORDS and then in the bigger ones, and
+ * return them zeroed; or return NULL if no hole fits. The caller holds
+ * allocation_lock. */
+static lispobj *
+alloc_code_hole(sword_t nwords)
+{
+    int bin, ret;
+    lispobj **prev, *hole = NULL;
+    sword_t size = 0;
+    page_index_t i, last;
+
+    for (bin = code_hole_bin(nwords); bin < CODE_HOLE_BINS && !hole; bin++)
+        for (prev = &code_holes[bin]; *prev; prev = (lispobj **)&(*prev)[2]) {
+            size = fixnum_value((*prev)[1]) + 2;
+            if (size >= nwords) {
+                hole = *prev;
+                *prev = (lispobj *)hole[2];
+                break;
+            }
+        }
+    if (!hole)
+        return NULL;
+
+    /* The hole may be on an older generation's pages, which the new
+     * object can then point from to younger ones: make sure they are
+     * scavenged as roots. */
+    ret = thread_mutex_lock(&free_pages_lock);
+    gc_assert(ret == 0);
+    last = find_page_index(hole + size - 1);
+    for (i = find_page_index(hole); i <= last; i++)
+        if (page_table[i].write_protected) {
+            os_protect(page_address(i), GENCGC_CARD_BYTES, OS_VM_PROT_ALL);
+            page_table[i].write_protected = 0;
+            page_table[i].write_protected_cleared = 1;
+        }
+    ret = thread_mutex_unlock(&free_pages_lock);
+    gc_assert(ret == 0);
+
+    if (size > nwords) {
+        add_code_hole(hole + nwords, size - nwords);
+        set_object_start(hole + nwords);
+    }
+    memset(hole, 0, nwords * N_WORD_BYTES);
+    return hole;
+}
+
+/* Sweep the code pages of from_space once everything reachable has
+ * been scavenged. Blocks holding marked code are kept, moving to
+ * new_space as pinned pages do. Each run of unmarked objects in them
+ * becomes a single unboxed filler object listed in code_holes, except
+ * that whole pages of it are left in from_space for free_oldspace(),
+ * splitting the block there, and a run at the end of the block is cut
+ * off it. Blocks with nothing marked are left for free_oldspace()
+ * whole. */
+static void
+sweep_code_pages(void)
+{
+    page_index_t first, last, i, lo, hi;
+    lispobj *where, *end, *hole;
+    boolean live;
+
+    forget_from_space_code_holes();
+    if (gencgc_move_code)
+        return;
+    for (first = 0; first < last_free_page; first = last + 1) {
+        last = first;
+        if ((page_table[first].allocated != CODE_PAGE_FLAG)
+            || (page_table[first].gen != from_space)
+            || (page_table[first].bytes_used == 0)
+            || (page_table[first].region_start_offset != 0))
+            continue;
+        while ((page_table[last].bytes_used == GENCGC_CARD_BYTES)
+               && (last + 1 < last_free_page)
+               && (page_table[last+1].allocated == CODE_PAGE_FLAG)
+               && (page_table[last+1].gen == from_space)
+               && (page_table[last+1].region_start_offset != 0))
+            last++;
+
+        end = (lispobj *)(page_address(last) + page_table[last].bytes_used);
+        live = 0;
+        for (where = (lispobj *)page_address(first); where < end;
+             where += object_size_words(where))
+            if (code_mark_bit_p(object_start_bit(where))) {
+                live = 1;
+                break;
+            }
+        if (!live)
+            continue;
+
+        for (i = first; i <= last; i++) {
+            page_table[i].gen = new_space;
+            generations[new_space].bytes_allocated += page_table[i].bytes_used;
+            generations[from_space].bytes_allocated -= page_table[i].bytes_used;
+        }
+        where = (lispobj *)page_address(first);
+        while (where < end) {
+            if (code_mark_bit_p(object_start_bit(where))) {
+                where += object_size_words(where);
+                continue;
+            }
+            hole = where;
+            do
+                where += object_size_words(where);
+            while ((where < end) && !code_mark_bit_p(object_start_bit(where)));
+            clear_object_start_range(hole, where);
+
+            /* The pages from LO up to HI hold nothing else. */
+            lo = find_page_index(hole) + !page_aligned_p(hole);
+            hi = (where == end) ? last + 1 : find_page_index(where);
+            if (lo < hi) {
+                for (i = lo; i < hi; i++) {
+                    page_table[i].region_start_offset = npage_bytes(i - lo);
+                    page_table[i].gen = from_space;
+                    generations[from_space].bytes_allocated +=
+                        page_table[i].bytes_used;
+                    generations[new_space].bytes_allocated -=
+                        page_table[i].bytes_used;
+                }
+                /* What follows starts a block of its own. */
+                if (hi <= last) {
+                    for (i = hi; i <= last; i++)
+                        page_table[i].region_start_offset =
+                            npage_bytes(i - hi);
+                    if ((lispobj *)page_address(hi) < where) {
+                        add_code_hole((lispobj *)page_address(hi),
+                                      where - (lispobj *)page_address(hi));
+                        set_object_start(page_address(hi));
+                    }
+                }
+            }
+            if (lo < hi && page_aligned_p(hole))
+                continue;
+            if (where == end) {
+                /* Cut the block short, leaving the rest of its last
+                 * page zeroed for allocation. */
+                page_index_t page = find_page_index(hole);
+                lispobj *stop = (lo < hi) ? (lispobj *)page_address(lo) : end;
+                os_vm_size_t cut = (char *)stop - (char *)hole;
+                memset(hole, 0, cut);
+                page_table[page].bytes_used -= cut;
+                generations[new_space].bytes_allocated -= cut;
+                bytes_allocated -= cut;
+            } else if (lo < hi) {
+                add_code_hole(hole, (lispobj *)page_address(lo) - hole);
+                set_object_start(hole);
+            } else {
+                add_code_hole(hole, where - hole);
+                set_object_start(hole);
+            }
+        }
+        memset(code_mark_bits
+               + object_start_bit(page_address(first)) / N_WORD_BITS,
+               0, (last - first + 1) * (OBJECT_START_BITS_PER_PAGE / 8));
+    }
+}
+
 /* Do one full scan of the new space generation. This is not enough to
  * complete the job as new objects may be added to the generation in
  * the process which are not scavenged. */
@@ -2663,11 +3950,12 @@ scavenge_newspace_generation(generation_index_t generation)
     /* Record all new areas now. */
     record_new_objects = 2;
 
-    /* Give a chance to weak hash tables to make other objects live.
-     * FIXME: The algorithm implemented here for weak hash table gcing
-     * is O(W^2+N) as Bruno Haible warns in
-     * http://www.haible.de/bruno/papers/cs/weak/WeakDatastructures-writeup.html
-     * see "Implementation 2". */
+    /* The code reached so far, which stays in from_space. */
+    scavenge_marked_code();
+
+    /* Give a chance to weak hash tables to make other objects live:
+     * this scavenges the entries whose triggers were reached during
+     * the scan. */
     scav_weak_hash_tables();
 
     /* Flush the current regions updating the tables. */
@@ -2680,7 +3968,8 @@ scavenge_newspace_generation(generation_index_t generation)
              "The first scan is finished; current_new_areas_index=%d.\n",
              current_new_areas_index));*/
 
-    while (current_new_areas_index > 0) {
+    while ((current_new_areas_index > 0)
+           || (code_scan_start < code_scan_end)) {
         /* Move the current to the previous new areas */
         previous_new_areas = current_new_areas;
         previous_new_areas_index = current_new_areas_index;
@@ -2718,6 +4007,7 @@ scavenge_newspace_generation(generation_index_t generation)
             /* Record all new areas now. */
             record_new_objects = 2;
 
+            scavenge_marked_code();
             scav_weak_hash_tables();
 
             /* Flush the current regions updating the tables. */
@@ -2734,6 +4024,7 @@ scavenge_newspace_generation(generation_index_t generation)
                 scavenge(page_address(page)+offset, size);
             }
 
+            scavenge_marked_code();
             scav_weak_hash_tables();
 
             /* Flush the current regions updating the tables. */
@@ -2848,6 +4139,8 @@ free_oldspace(void)
                 page_table[last_page].bytes_used;
             page_table[last_page].allocated = FREE_PAGE_FLAG;
             page_table[last_page].bytes_used = 0;
+            page_wp_faults[last_page] = 0;
+            clear_object_starts(last_page);
             /* Should already be unprotected by unprotect_oldspace(). */
             gc_assert(!page_table[last_page].write_protected);
             last_page++;
@@ -3300,7 +4593,7 @@ write_protect_generation_pages(generation_index_t generation)
     gc_assert(generation < SCRATCH_GENERATION);
 
     for (start = 0; start < last_free_page; start++) {
-        if (protect_page_p(start, generation)) {
+        if (protect_page_p(start, generation) && !page_hot_p(start)) {
             void *page_start;
             page_index_t last;
 
@@ -3308,7 +4601,7 @@ write_protect_generation_pages(generation_index_t generation)
             page_table[start].write_protected = 1;
 
             for (last = start + 1; last < last_free_page; last++) {
-                if (!protect_page_p(last, generation))
+                if (!protect_page_p(last, generation) || page_hot_p(last))
                   break;
                 page_table[last].write_protected = 1;
             }
@@ -3386,6 +4679,7 @@ garbage_collect_generation(generation_index_t generation, int raise)
     page_index_t i;
     uword_t static_space_size;
     struct thread *th;
+    uword_t phase_start;
 
     gc_assert(generation <= HIGHEST_NORMAL_GENERATION);
 
@@ -3420,6 +4714,10 @@ garbage_collect_generation(generation_index_t generation, int raise)
     generations[new_space].alloc_large_start_page = 0;
     generations[new_space].alloc_large_unboxed_start_page = 0;
 
+    /* No code has been reached yet. */
+    code_scan_start = page_table_pages;
+    code_scan_end = 0;
+
     /* Before any pointers are preserved, the dont_move flags on the
      * pages need to be cleared. */
     for (i = 0; i < last_free_page; i++)
@@ -3433,6 +4731,8 @@ garbage_collect_generation(generation_index_t generation, int raise)
      * be un-protected anyway before unmapping later. */
     unprotect_oldspace();
 
+    phase_start = gc_clock_usec();
+
     /* Scavenge the stacks' conservative roots. */
 
     /* there are potentially two stacks for each thread: the main
@@ -3460,7 +4760,9 @@ garbage_collect_generation(generation_index_t generation, int raise)
         for_each_thread(th) {
             if (th->state == STATE_DEAD)
                 continue;
+#if !(defined(LISP_FEATURE_X86_64) && defined(LISP_FEATURE_SB_GC_SAFEPOINT))
             void **ptr;
+#endif
             void **esp=(void **)-1;
 #ifdef LISP_FEATURE_SB_THREAD
             intptr_t i,free;
@@ -3511,9 +4813,13 @@ garbage_collect_generation(generation_index_t generation, int raise)
             esp = (void **)((void *)&raise);
 #endif
             gc_assert(esp);
+#if defined(LISP_FEATURE_X86_64) && defined(LISP_FEATURE_SB_GC_SAFEPOINT)
+            preserve_thread_stack(th, esp, th->fp_around_foreign_call);
+#else
             for (ptr = ((void **)th->control_stack_end)-1; ptr >= esp;  ptr--) {
                 preserve_pointer(*ptr);
             }
+#endif
         }
     }
 #else
@@ -3531,6 +4837,14 @@ garbage_collect_generation(generation_index_t generation, int raise)
     }
 #endif
 
+    limit_evacuation();
+#if defined(LISP_FEATURE_X86_64) && defined(LISP_FEATURE_SB_GC_SAFEPOINT)
+    scavenge_precise_stack_roots();
+#endif
+
+    gc_event->roots_usec += gc_clock_usec() - phase_start;
+    phase_start = gc_clock_usec();
+
 #if QSHOW
     if (gencgc_verbose > 1) {
         intptr_t num_dont_move_pages = count_dont_move_pages();
@@ -3655,14 +4969,23 @@ garbage_collect_generation(generation_index_t generation, int raise)
     }
 #endif
 
+    gc_event->scavenge_usec += gc_clock_usec() - phase_start;
+    phase_start = gc_clock_usec();
+
     scan_weak_hash_tables();
     scan_weak_pointers();
 
+    gc_event->weak_usec += gc_clock_usec() - phase_start;
+
+    sweep_code_pages();
+
     /* Flush the current regions, updating the tables. */
     gc_alloc_update_all_page_tables();
 
     /* Free the pages in oldspace, but not those marked dont_move. */
+    phase_start = gc_clock_usec();
     bytes_freed = free_oldspace();
+    gc_event->free_usec += gc_clock_usec() - phase_start;
 
     /* If the GC is not raising the age then lower the generation back
      * to its normal generation number */
@@ -3773,8 +5096,213 @@ remap_free_pages (page_index_t from, page_index_t to, int forcibly)
     }
 }
 
+#ifdef LISP_FEATURE_SB_THREAD
+/* Releasing the free pages to the OS after a big collection can take
+ * a good part of the pause. With this set, a helper thread does it
+ * once the world has been restarted instead. It holds free_pages_lock
+ * for a chunk of pages at a time, so allocation can go on meanwhile,
+ * and gc_release_lock while it is busy, which collections take to
+ * keep it out of their way. Pages it hasn't got to by the time they
+ * are allocated are zeroed then, as usual. Set by the runtime option
+ * --gc-background-release. */
+boolean gencgc_background_release = 0;
+
+#define GC_RELEASE_CHUNK_PAGES 256
+
+static pthread_mutex_t gc_release_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_release_wanted;
+/* release the free pages below this one, or 0 for none */
+static page_index_t gc_release_end = 0;
+static boolean gc_release_started = 0;
+#endif
+
+/* The end of the part of dynamic space which was mapped from the core
+ * file rather than allocated, if any. set by coreparse.c */
+os_vm_address_t gencgc_core_mapped_end = 0;
+
+#ifdef LISP_FEATURE_SB_THREAD
+
+/* Like remap_page_range(), but safe while other threads run: the
+ * mapping is never taken down, so nothing else can be mapped in its
+ * place meanwhile. */
+static void
+release_page_range(page_index_t from, page_index_t to)
+{
+#if defined(LISP_FEATURE_LINUX)
+    page_index_t i;
+
+    if (madvise(page_address(from), npage_bytes(1+to-from), MADV_DONTNEED)) {
+        zero_and_mark_pages(from, to);
+        return;
+    }
+    /* Private anonymous memory reads as zero after this, but pages
+     * mapped privately from the core file read as the file again, so
+     * those still need zeroing when they are allocated. */
+    i = from;
+    if (gencgc_core_mapped_end) {
+        page_index_t core_end = find_page_index(gencgc_core_mapped_end);
+        if ((core_end == -1) || (core_end > to))
+            return;
+        if (core_end > i)
+            i = core_end;
+    }
+    for (; i <= to; i++)
+        page_table[i].need_to_zero = 0;
+#elif defined(LISP_FEATURE_WIN32)
+    zero_pages_with_mmap(from, to);
+#else
+    zero_and_mark_pages(from, to);
+#endif
+}
+
+static void *
+gc_release_main(void *ignored)
+{
+    page_index_t first, last, end, page;
+
+    thread_mutex_lock(&gc_release_lock);
+    for (;;) {
+        while (gc_release_end == 0)
+            pthread_cond_wait(&gc_release_wanted, &gc_release_lock);
+        end = gc_release_end;
+        gc_release_end = 0;
+        for (page = 0; page < end; page += GC_RELEASE_CHUNK_PAGES) {
+            thread_mutex_lock(&free_pages_lock);
+            for (first = page;
+                 (first < end) && (first < page + GC_RELEASE_CHUNK_PAGES);
+                 first = last) {
+                last = first + 1;
+                if (page_allocated_p(first)
+                    || (page_table[first].need_to_zero == 0))
+                    continue;
+                while ((last < end) && page_free_p(last)
+                       && (page_table[last].need_to_zero == 1))
+                    last++;
+                release_page_range(first, last-1);
+            }
+            thread_mutex_unlock(&free_pages_lock);
+            /* Let a collection in between chunks. */
+            thread_mutex_unlock(&gc_release_lock);
+            thread_mutex_lock(&gc_release_lock);
+        }
+    }
+    return NULL;
+}
+
+/* Start the release thread the first time it's needed, with signals
+ * blocked as for the GC helper threads. Returns whether it's running. */
+static boolean
+gc_start_release_thread(void)
+{
+    static boolean tried = 0;
+    sigset_t all, old;
+    pthread_t tid;
+
+    if (tried)
+        return gc_release_started;
+    tried = 1;
+
+    pthread_cond_init(&gc_release_wanted, NULL);
+    sigfillset(&all);
+    thread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&tid, NULL, gc_release_main, NULL) == 0) {
+        pthread_detach(tid);
+        gc_release_started = 1;
+    } else
+        FSHOW((stderr, "/could not start GC release thread\n"));
+    thread_sigmask(SIG_SETMASK, &old, 0);
+    return gc_release_started;
+}
+#endif
+
+/* Release the free pages up to TO to the OS, in the background if
+ * that's enabled. Called with gc_release_lock held. */
+static void
+release_free_pages(page_index_t to)
+{
+#ifdef LISP_FEATURE_SB_THREAD
+    if (gencgc_background_release && gc_start_release_thread()) {
+        page_index_t end = (to < page_table_pages) ? to + 1 : page_table_pages;
+        if (end > gc_release_end)
+            gc_release_end = end;
+        pthread_cond_signal(&gc_release_wanted);
+        return;
+    }
+#endif
+    remap_free_pages(0, to, 0);
+}
+
 generation_index_t small_generation_limit = 1;
 
+/* the limits within which a pause target may move the nursery size */
+#define NURSERY_MIN_BYTES (1024*1024)
+#define NURSERY_MAX_BYTES (dynamic_space_size/20)
+
+/* Size the nursery for the next collection after one which took PAUSE
+ * microseconds and got no further than generation LAST. A nursery
+ * collection copies what survives of the nursery, so its pause shrinks
+ * with the nursery; older generations have to be collected sometime
+ * whatever its size, so only nursery collections are counted. */
+static void
+adapt_nursery_size(uword_t pause, generation_index_t last)
+{
+    uword_t target = gencgc_pause_target, ratio = 256;
+    os_vm_size_t size = bytes_consed_between_gcs;
+
+    if (last > 0)
+        return;
+    /* Scale by target/pause in 1/256ths, halving at most, and grow
+     * gently while well under the target. */
+    if (pause > target) {
+        ratio = target / ((pause >> 8) + 1);
+        if (ratio < 128)
+            ratio = 128;
+    } else if (pause < target/2)
+        ratio = 320;
+    size = (size >> 8) * ratio;
+    if (size < NURSERY_MIN_BYTES)
+        size = NURSERY_MIN_BYTES;
+    if (size > NURSERY_MAX_BYTES)
+        size = NURSERY_MAX_BYTES;
+    if (gencgc_verbose && (size != bytes_consed_between_gcs))
+        FSHOW((stderr, "/pause %lu us, nursery now %lu bytes\n",
+               (unsigned long)pause, (unsigned long)size));
+    bytes_consed_between_gcs = size;
+}
+
+/* Adjust when generation GEN gets collected or promoted, after a
+ * collection in which SURVIVED of its BEFORE bytes survived. */
+static void
+adapt_generation_policy(generation_index_t gen,
+                        os_vm_size_t before, os_vm_size_t survived)
+{
+    struct generation *g = &generations[gen];
+
+    if (before == 0)
+        return;
+    if (gen == 0) {
+        /* Nursery survivors which are kept in the nursery get copied
+         * again at the next collection: if many survive, they're
+         * probably long-lived, so promote them straight away. */
+        if (survived > before/4)
+            g->number_of_gcs_before_promotion = 0;
+        else if (survived < before/16)
+            g->number_of_gcs_before_promotion = 1;
+    } else {
+        /* An older generation which turned out to be mostly live was
+         * collected too soon: let it age more before the next time,
+         * and less once collecting it pays off again. */
+        if (survived > before - before/8) {
+            if (g->minimum_age_before_gc < AGE_MAX*AGE_SCALE/2)
+                g->minimum_age_before_gc += g->minimum_age_before_gc/4;
+        } else if (survived < before/2) {
+            g->minimum_age_before_gc -= g->minimum_age_before_gc/4;
+            if (g->minimum_age_before_gc < (AGE_SCALE/4)*3)
+                g->minimum_age_before_gc = (AGE_SCALE/4)*3;
+        }
+    }
+}
+
 /* GC all generations newer than last_gen, raising the objects in each
  * to the next older generation - we finish when all generations below
  * last_gen are empty.  Then if last_gen is due for a GC, or if
@@ -3789,6 +5317,8 @@ collect_garbage(generation_index_t last_gen)
     generation_index_t gen = 0, i;
     int raise, more = 0;
     int gen_to_wp;
+    os_vm_size_t before, survived;
+    uword_t start_usec = gc_clock_usec(), phase_start;
     /* The largest value of last_free_page seen since the time
      * remap_free_pages was called. */
     static page_index_t high_water_mark = 0;
@@ -3797,6 +5327,16 @@ collect_garbage(generation_index_t last_gen)
     log_generation_stats(gc_logfile, "=== GC Start ===");
 
     gc_active_p = 1;
+#ifdef LISP_FEATURE_SB_THREAD
+    /* Keep the release thread out of the way until we're done. */
+    if (gencgc_background_release)
+        thread_mutex_lock(&gc_release_lock);
+#endif
+    gc_event = &gc_events[gc_event_count % GC_EVENT_LOG_SIZE];
+    memset(gc_event, 0, sizeof(struct gc_event));
+    gc_event->number = gc_event_count;
+    gc_event->stop_usec = gc_stop_the_world_usec;
+    gc_stop_the_world_usec = 0;
 
 #ifdef LISP_FEATURE_WIN32
     os_commit_wp_violation_data(1);
@@ -3860,8 +5400,23 @@ collect_garbage(generation_index_t last_gen)
                 generations[gen+1].bytes_allocated;
         }
 
+        before = generations[gen].bytes_allocated;
+        survived = raise ? generations[gen+1].bytes_allocated : 0;
+
         garbage_collect_generation(gen, raise);
 
+        if (raise)
+            survived = generations[gen+1].bytes_allocated - survived;
+        else
+            survived = generations[gen].bytes_allocated;
+        gc_event->generation = gen;
+        gc_event->bytes_before[gen] = before;
+        gc_event->bytes_survived[gen] = survived;
+        if (raise)
+            gc_event->raised |= 1 << gen;
+        if (gencgc_pause_target)
+            adapt_generation_policy(gen, before, survived);
+
         /* Reset the memory age cum_sum. */
         generations[gen].cum_sum_bytes_allocated = 0;
 
@@ -3908,6 +5463,7 @@ collect_garbage(generation_index_t last_gen)
     /* Set gc_alloc() back to generation 0. The current regions should
      * be flushed after the above GCs. */
     gc_assert((boxed_region.free_pointer - boxed_region.start_addr) == 0);
+    gc_assert((code_region.free_pointer - code_region.start_addr) == 0);
     gc_alloc_generation = 0;
 
     /* Save the high-water mark before updating last_free_page */
@@ -3916,6 +5472,9 @@ collect_garbage(generation_index_t last_gen)
 
     update_dynamic_space_free_pointer();
 
+    if (gencgc_pause_target)
+        adapt_nursery_size(gc_clock_usec() - start_usec, gen - 1);
+
     /* Update auto_gc_trigger. Make sure we trigger the next GC before
      * running out of heap! */
     if (bytes_consed_between_gcs <= (dynamic_space_size - bytes_allocated))
@@ -3933,7 +5492,9 @@ collect_garbage(generation_index_t last_gen)
     if (gen > small_generation_limit) {
         if (last_free_page > high_water_mark)
             high_water_mark = last_free_page;
-        remap_free_pages(0, high_water_mark, 0);
+        phase_start = gc_clock_usec();
+        release_free_pages(high_water_mark);
+        gc_event->free_usec += gc_clock_usec() - phase_start;
         high_water_mark = 0;
     }
 
@@ -3943,6 +5504,13 @@ collect_garbage(generation_index_t last_gen)
 #endif
     large_allocation = 0;
 
+    gc_event->total_usec = gc_clock_usec() - start_usec;
+    gc_event_count++;
+#ifdef LISP_FEATURE_SB_THREAD
+    if (gencgc_background_release)
+        thread_mutex_unlock(&gc_release_lock);
+#endif
+
     log_generation_stats(gc_logfile, "=== GC End ===");
     SHOW("returning from collect_garbage");
 }
@@ -3976,6 +5544,7 @@ gc_free_heap(void)
                 page_table[page].allocated = FREE_PAGE_FLAG;
                 page_table[page].bytes_used = 0;
                 page_table[page].write_protected = 0;
+                page_wp_faults[last_page] = 0;
             }
 
 #ifndef LISP_FEATURE_WIN32 /* Pages already zeroed on win32? Not sure
@@ -3999,6 +5568,12 @@ gc_free_heap(void)
             }
         }
     }
+    memset(object_start_bits, 0,
+           page_table_pages * (OBJECT_START_BITS_PER_PAGE / 8));
+    memset(page_starts_bytes, 0, page_table_pages * sizeof(page_bytes_t));
+    memset(code_mark_bits, 0,
+           page_table_pages * (OBJECT_START_BITS_PER_PAGE / 8));
+    memset(code_holes, 0, sizeof(code_holes));
 
     bytes_allocated = 0;
 
@@ -4022,6 +5597,7 @@ gc_free_heap(void)
 
     gc_set_region_empty(&boxed_region);
     gc_set_region_empty(&unboxed_region);
+    gc_set_region_empty(&code_region);
 
     last_free_page = 0;
     set_alloc_pointer((lispobj)((char *)heap_base));
@@ -4062,6 +5638,16 @@ gc_init(void)
      * unnecessary and did hurt startup time. */
     page_table = calloc(page_table_pages, sizeof(struct page));
     gc_assert(page_table);
+    page_wp_faults = calloc(page_table_pages, 1);
+    gc_assert(page_wp_faults);
+    object_start_bits = calloc(page_table_pages,
+                               OBJECT_START_BITS_PER_PAGE / 8);
+    gc_assert(object_start_bits);
+    page_starts_bytes = calloc(page_table_pages, sizeof(page_bytes_t));
+    gc_assert(page_starts_bytes);
+    code_mark_bits = calloc(page_table_pages,
+                            OBJECT_START_BITS_PER_PAGE / 8);
+    gc_assert(code_mark_bits);
 
     gc_init_tables();
     scavtab[WEAK_POINTER_WIDETAG] = scav_weak_pointer;
@@ -4122,12 +5708,14 @@ gc_init(void)
             = bytes_consed_between_gcs/(os_vm_size_t)HIGHEST_NORMAL_GENERATION;
         generations[i].number_of_gcs_before_promotion = 1;
         generations[i].minimum_age_before_gc = (AGE_SCALE/4)*3;
+        generations[i].evacuation_limit = 0;
     }
 
     /* Initialize gc_alloc. */
     gc_alloc_generation = 0;
     gc_set_region_empty(&boxed_region);
     gc_set_region_empty(&unboxed_region);
+    gc_set_region_empty(&code_region);
 
     last_free_page = 0;
 }
@@ -4144,6 +5732,7 @@ gencgc_pickup_dynamic(void)
     void *alloc_ptr = (void *)get_alloc_pointer();
     lispobj *prev=(lispobj *)page_address(page);
     generation_index_t gen = PSEUDO_STATIC_GENERATION;
+    os_vm_size_t bytes = 0;
     do {
         lispobj *first,*ptr= (lispobj *)page_address(page);
 
@@ -4151,8 +5740,6 @@ gencgc_pickup_dynamic(void)
           /* It is possible, though rare, for the saved page table
            * to contain free pages below alloc_ptr. */
           page_table[page].gen = gen;
-          page_table[page].bytes_used = GENCGC_CARD_BYTES;
-          page_table[page].large_object = 0;
           page_table[page].write_protected = 0;
           page_table[page].write_protected_cleared = 0;
           page_table[page].dont_move = 0;
@@ -4161,19 +5748,24 @@ gencgc_pickup_dynamic(void)
 
         if (!gencgc_partial_pickup) {
             page_table[page].allocated = BOXED_PAGE_FLAG;
+            page_table[page].bytes_used = GENCGC_CARD_BYTES;
+            page_table[page].large_object = 0;
             first=gc_search_space(prev,(ptr+2)-prev,ptr);
             if(ptr == first)
                 prev=ptr;
             page_table[page].region_start_offset =
                 page_address(page) - (void *)prev;
         }
+        /* The saved page table has the real bytes_used, and needs no
+         * walking of the heap. */
+        bytes += page_table[page].bytes_used;
         page++;
     } while (page_address(page) < alloc_ptr);
 
     last_free_page = page;
 
-    generations[gen].bytes_allocated = npage_bytes(page);
-    bytes_allocated = npage_bytes(page);
+    generations[gen].bytes_allocated = bytes;
+    bytes_allocated = bytes;
 
     gc_alloc_update_all_page_tables();
     write_protect_generation_pages(gen);
@@ -4273,6 +5865,13 @@ general_alloc_internal(sword_t nbytes, int page_type_flag, struct alloc_region *
             }
         }
     }
+#ifdef LISP_FEATURE_SB_THREAD
+    if (thread && (page_type_flag == BOXED_PAGE_FLAG)
+        && (nbytes >= large_object_size)
+        && ((os_vm_size_t)nbytes <= gencgc_large_page_cache_bytes / 4))
+        new_obj = gc_alloc_large_cached(nbytes, &thread->large_page_cache);
+    else
+#endif
     new_obj = gc_alloc_with_region(nbytes, page_type_flag, region, 0);
 
 #ifndef LISP_FEATURE_WIN32
@@ -4300,7 +5899,18 @@ general_alloc(sword_t nbytes, int page_type_flag)
   /* Select correct region, and call general_alloc_internal with it.
    * For other then boxed allocation we must lock first, since the
    * region is shared. */
-  if (BOXED_PAGE_FLAG & page_type_flag) {
+  if (CODE_PAGE_FLAG == page_type_flag) {
+      /* Code goes on code pages from the start, so that it never
+       * has to be moved. */
+      int ret;
+      ret = thread_mutex_lock(&allocation_lock);
+      gc_assert(ret == 0);
+      result = alloc_code_hole(nbytes / N_WORD_BYTES);
+      if (!result)
+          result = general_alloc_internal(nbytes, page_type_flag, &code_region, thread);
+      ret = thread_mutex_unlock(&allocation_lock);
+      gc_assert(ret == 0);
+  } else if (BOXED_PAGE_FLAG & page_type_flag) {
 #ifdef LISP_FEATURE_SB_THREAD
       struct alloc_region *region = (thread ? &(thread->alloc_region) : &boxed_region);
 #else
@@ -4387,6 +5997,8 @@ gencgc_handle_wp_violation(void* fault_addr)
             os_protect(page_address(page_index), GENCGC_CARD_BYTES, OS_VM_PROT_ALL);
             page_table[page_index].write_protected_cleared = 1;
             page_table[page_index].write_protected = 0;
+            if (page_wp_faults[page_index] < PAGE_WP_FAULTS_MAX - 1)
+                page_wp_faults[page_index] += 2;
         } else if (!ignore_memoryfaults_on_unprotected_pages) {
             /* The only acceptable reason for this signal on a heap
              * access is that GENCGC write-protected the page.
@@ -4439,10 +6051,15 @@ void gc_alloc_update_all_page_tables(void)
 {
     /* Flush the alloc regions updating the tables. */
     struct thread *th;
-    for_each_thread(th)
+    for_each_thread(th) {
         gc_alloc_update_page_tables(BOXED_PAGE_FLAG, &th->alloc_region);
+#ifdef LISP_FEATURE_SB_THREAD
+        gc_flush_large_page_cache(&th->large_page_cache);
+#endif
+    }
     gc_alloc_update_page_tables(UNBOXED_PAGE_FLAG, &unboxed_region);
     gc_alloc_update_page_tables(BOXED_PAGE_FLAG, &boxed_region);
+    gc_alloc_update_page_tables(CODE_PAGE_FLAG, &code_region);
 }
 
 void
@@ -4515,6 +6132,8 @@ gc_and_save(char *filename, boolean prepend_runtime,
        return;
 
     conservative_stack = 0;
+    /* Compact code along with everything else. */
+    gencgc_move_code = 1;
 
     /* The filename might come from Lisp, and be moved by the now
      * non-conservative GC. */
@@ -568,6 +568,26 @@ main(int argc, char *argv[], char *envp[])
             } else if (0 == strcmp(arg, "--default-merge-core-pages")) {
                 ++argi;
                 merge_core_pages = -1;
+            } else if (0 == strcmp(arg, "--perf-map")) {
+                ++argi;
+                perf_map_enabled = 1;
+#if defined(LISP_FEATURE_GENCGC) && defined(LISP_FEATURE_SB_THREAD)
+            } else if (0 == strcmp(arg, "--gc-threads")) {
+                char *tail;
+                long n;
+                ++argi;
+                if (argi >= argc)
+                    lose("missing argument for --gc-threads");
+                n = strtol(argv[argi], &tail, 10);
+                if ((tail == argv[argi]) || tail[0] || (n < 1) || (n > 256))
+                    lose("--gc-threads argument is not a number from 1 to 256: %s",
+                         argv[argi]);
+                gencgc_gc_threads = (int)n;
+                ++argi;
+            } else if (0 == strcmp(arg, "--gc-background-release")) {
+                ++argi;
+                gencgc_background_release = 1;
+#endif
             } else {
                 /* This option was unrecognized as a runtime option,
                  * so it must be a toplevel option or a user option,
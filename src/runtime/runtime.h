@@ -314,4 +314,7 @@ other_immediate_lowtag_p(lispobj header)
 extern void *successful_malloc (size_t size);
 extern char *copied_string (char *string);
 
+extern boolean perf_map_enabled;
+extern void perf_map_note_code(lispobj code);
+
 #endif /* _SBCL_RUNTIME_H_ */
@@ -74,6 +74,87 @@ write_lispobj(lispobj obj, FILE *file)
     }
 }
 
+#ifdef LISP_FEATURE_SB_CORE_COMPRESSION
+struct deflate_work {
+    char *in;
+    uword_t in_len;
+    int level;
+    unsigned char **out;
+    uword_t *out_sizes;
+    int *status;
+};
+
+static void
+deflate_chunk(void *arg, uword_t chunk)
+{
+    struct deflate_work *work = arg;
+    uword_t start = chunk * CORE_COMPRESSION_CHUNK_BYTES;
+    uLong len = (work->in_len - start > CORE_COMPRESSION_CHUNK_BYTES)
+        ? CORE_COMPRESSION_CHUNK_BYTES : work->in_len - start;
+    uLongf out_len = compressBound(len);
+
+    work->out[chunk] = malloc(out_len);
+    if (!work->out[chunk]) {
+        work->status[chunk] = Z_MEM_ERROR;
+        return;
+    }
+    work->status[chunk] = compress2(work->out[chunk], &out_len,
+                                    (void*)(work->in + start), len,
+                                    work->level);
+    work->out_sizes[chunk] = out_len;
+}
+
+static void
+write_or_lose(FILE *file, void *addr, uword_t bytes)
+{
+    if (bytes && 1 != fwrite(addr, bytes, 1, file))
+        lose("unable to write to core file\n");
+}
+
+/* Deflate BYTES at ADDR in CORE_COMPRESSION_CHUNK_BYTES pieces, in
+ * parallel, and write them out behind their index (see core.h). */
+static void
+write_compressed_chunks(FILE *file, char *addr, uword_t bytes, int level)
+{
+    struct deflate_work work;
+    uword_t header[2], nchunks, total = 0, i;
+
+    nchunks = (bytes + CORE_COMPRESSION_CHUNK_BYTES - 1)
+        / CORE_COMPRESSION_CHUNK_BYTES;
+    work.in = addr;
+    work.in_len = bytes;
+    work.level = level;
+    work.out = calloc(nchunks, sizeof(unsigned char *));
+    work.out_sizes = calloc(nchunks, sizeof(uword_t));
+    work.status = calloc(nchunks, sizeof(int));
+    if (nchunks && (!work.out || !work.out_sizes || !work.status))
+        lose("unable to allocate the compressed core chunk index\n");
+
+    core_map_chunks(deflate_chunk, &work, nchunks);
+
+    for (i = 0; i < nchunks; i++) {
+        if (work.status[i] != Z_OK)
+            lose("zlib deflate error %i in core chunk %lu\n",
+                 work.status[i], (unsigned long)i);
+        total += work.out_sizes[i];
+    }
+    header[0] = CORE_COMPRESSION_CHUNK_BYTES;
+    header[1] = nchunks;
+    write_or_lose(file, header, sizeof(header));
+    write_or_lose(file, work.out_sizes, nchunks * sizeof(uword_t));
+    for (i = 0; i < nchunks; i++) {
+        write_or_lose(file, work.out[i], work.out_sizes[i]);
+        free(work.out[i]);
+    }
+    free(work.status);
+    free(work.out_sizes);
+    free(work.out);
+    printf("compressed %lu bytes into %lu in %lu chunks at level %i\n",
+           (unsigned long)bytes, (unsigned long)total,
+           (unsigned long)nchunks, level);
+}
+#endif
+
 static void
 write_bytes_to_file(FILE * file, char *addr, long bytes, int compression)
 {
@@ -91,41 +172,7 @@ write_bytes_to_file(FILE * file, char *addr, long bytes, int compression)
         }
 #ifdef LISP_FEATURE_SB_CORE_COMPRESSION
     } else if ((compression >= -1) && (compression <= 9)) {
-# define ZLIB_BUFFER_SIZE (1u<<16)
-        z_stream stream;
-        unsigned char buf[ZLIB_BUFFER_SIZE];
-        unsigned char * written, * end;
-        long total_written = 0;
-        int ret;
-        stream.zalloc = NULL;
-        stream.zfree = NULL;
-        stream.opaque = NULL;
-        stream.avail_in = bytes;
-        stream.next_in  = (void*)addr;
-        ret = deflateInit(&stream, compression);
-        if (ret != Z_OK)
-            lose("deflateInit: %i\n", ret);
-        do {
-            stream.avail_out = sizeof(buf);
-            stream.next_out = buf;
-            ret = deflate(&stream, Z_FINISH);
-            if (ret < 0) lose("zlib deflate error: %i... exiting\n", ret);
-            written = buf;
-            end     = buf+sizeof(buf)-stream.avail_out;
-            total_written += end - written;
-            while (written < end) {
-                long count = fwrite(written, 1, end-written, file);
-                if (count > 0) {
-                    written += count;
-                } else {
-                    lose("unable to write to core file\n");
-                }
-            }
-        } while (stream.avail_out == 0);
-        deflateEnd(&stream);
-        printf("compressed %lu bytes into %lu at level %i\n",
-               bytes, total_written, compression);
-# undef ZLIB_BUFFER_SIZE
+        write_compressed_chunks(file, addr, bytes, compression);
 #endif
     } else {
 #ifdef LISP_FEATURE_SB_CORE_COMPRESSION
@@ -308,7 +355,7 @@ save_to_filehandle(FILE *file, char *filename, lispobj init_function,
 
 #ifdef LISP_FEATURE_GENCGC
     {
-        os_vm_size_t size = (last_free_page*sizeof(intptr_t)+os_vm_page_size-1)
+        os_vm_size_t size = (last_free_page*2*sizeof(intptr_t)+os_vm_page_size-1)
             &~(os_vm_page_size-1);
         uword_t *data = calloc(size, 1);
         if (data) {
@@ -322,7 +369,12 @@ save_to_filehandle(FILE *file, char *filename, lispobj init_function,
                  * the two low bits of allocation flags matter. */
                 word = page_table[i].region_start_offset;
                 gc_assert((word & 0x03) == 0);
-                data[i] = word | (0x03 & page_table[i].allocated);
+                data[2*i] = word | (0x03 & page_table[i].allocated);
+                /* Likewise bytes_used, which is a multiple of two
+                 * words, leaves room for the large object flag. */
+                word = page_table[i].bytes_used;
+                gc_assert((word & 0x01) == 0);
+                data[2*i+1] = word | page_table[i].large_object;
             }
             write_lispobj(PAGE_TABLE_CORE_ENTRY_TYPE_CODE, file);
             write_lispobj(4, file);
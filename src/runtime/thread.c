@@ -16,6 +16,7 @@
 #include <string.h>
 #ifndef LISP_FEATURE_WIN32
 #include <sched.h>
+#include <unistd.h>
 #endif
 #include "runtime.h"
 #include "interrupt.h"
@@ -479,6 +480,18 @@ static inline boolean set_thread_csp_access(struct thread* p, boolean writable)
     return !!*p->csp_around_foreign_call;
 }
 
+/* The frame pointer the collector starts walking Lisp frames from.
+ * Zero sends it straight to conservative scanning, which is all a
+ * Windows context gets. */
+static inline lispobj *context_fp(os_context_t *ctxptr)
+{
+#ifdef LISP_FEATURE_WIN32
+    return 0;
+#else
+    return (lispobj *)*os_context_register_addr(ctxptr, reg_FP);
+#endif
+}
+
 static inline void gc_state_lock()
 {
     odxprint(safepoints,"GC state [%p] to be locked",gc_state.lock);
@@ -563,6 +576,7 @@ new_thread_trampoline(struct thread *th)
      * it is not). */
 
 #ifdef LISP_FEATURE_SB_GC_SAFEPOINT
+    th->fp_around_foreign_call = 0;
     *th->csp_around_foreign_call = (lispobj)&function;
     odxprint(safepoints, "New thread to be linked: %p\n", th);
 #endif
@@ -587,6 +601,7 @@ new_thread_trampoline(struct thread *th)
 #ifndef LISP_FEATURE_SB_GC_SAFEPOINT
     block_blockable_signals(0, 0);
     gc_alloc_update_page_tables(BOXED_PAGE_FLAG, &th->alloc_region);
+    gc_flush_large_page_cache(&th->large_page_cache);
     lock_ret = pthread_mutex_lock(&all_threads_lock);
     gc_assert(lock_ret == 0);
     unlink_thread(th);
@@ -597,6 +612,7 @@ new_thread_trampoline(struct thread *th)
 #else
     /* Here we know that GC is blocked -- we are in unsafe code */
     gc_alloc_update_page_tables(BOXED_PAGE_FLAG, &th->alloc_region);
+    gc_flush_large_page_cache(&th->large_page_cache);
     END_GC_UNSAFE_CODE;
     /* Here we are in a `foreign call' again. GC won't wait for us, so
        it's safe to unlink. */
@@ -797,6 +813,7 @@ create_thread_struct(lispobj initial_function) {
     th->gc_safepoint_context = 0;
     th->csp_around_foreign_call = 0;
     th->pc_around_foreign_call = 0;
+    th->fp_around_foreign_call = 0;
 #endif
 
 #ifdef LISP_FEATURE_SB_THREAD
@@ -830,6 +847,9 @@ create_thread_struct(lispobj initial_function) {
 #endif
 #ifdef LISP_FEATURE_GENCGC
     gc_set_region_empty(&th->alloc_region);
+#ifdef LISP_FEATURE_SB_THREAD
+    gc_set_region_empty(&th->large_page_cache);
+#endif
 #endif
 #ifdef LISP_FEATURE_SB_THREAD
     /* This parallels the same logic in globals.c for the
@@ -1343,6 +1363,7 @@ void thread_in_lisp_raised(os_context_t *ctxptr)
         SymbolTlValue(GC_PENDING,self)==T &&
         thread_gc_phase(self)==GC_NONE &&
         thread_may_gc() && SymbolTlValue(IN_SAFEPOINT,self)!=T) {
+        self->fp_around_foreign_call = context_fp(ctxptr);
         *self->csp_around_foreign_call = (word_t)ctxptr;
         gc_advance(GC_QUIET,GC_FLIGHT);
         set_thread_csp_access(self,1);
@@ -1364,6 +1385,7 @@ void thread_in_lisp_raised(os_context_t *ctxptr)
     if (phase == GC_NONE) {
         SetTlSymbolValue(STOP_FOR_GC_PENDING,NIL,self);
         set_thread_csp_access(self,1);
+        self->fp_around_foreign_call = context_fp(ctxptr);
         *self->csp_around_foreign_call = (word_t)ctxptr;
         if (gc_state.phase <= GC_SETTLED)
             gc_advance(phase,gc_state.phase);
@@ -1394,6 +1416,7 @@ void thread_in_safety_transition(os_context_t *ctxptr)
         gc_phase_t phase = thread_gc_phase(self);
         if (phase == GC_NONE) {
             SetTlSymbolValue(STOP_FOR_GC_PENDING,NIL,self);
+            self->fp_around_foreign_call = context_fp(ctxptr);
             *self->csp_around_foreign_call = (word_t)ctxptr;
             if (gc_state.phase <= GC_SETTLED)
                 gc_advance(phase,gc_state.phase);
@@ -1432,6 +1455,7 @@ void thread_interrupted(os_context_t *ctxptr)
 void gc_stop_the_world()
 {
     struct thread *self = arch_os_get_current_thread();
+    uword_t start = gc_clock_usec();
     odxprint(safepoints,"%s","stop the world");
     gc_state_lock();
     gc_state.collector = self;
@@ -1457,6 +1481,7 @@ void gc_stop_the_world()
     set_thread_csp_access(self,1);
     gc_state_unlock();
     SetTlSymbolValue(STOP_FOR_GC_PENDING,NIL,self);
+    gc_stop_the_world_usec = gc_clock_usec() - start;
 }
 
 void gc_start_the_world()
@@ -1515,6 +1540,7 @@ void gc_stop_the_world()
     int status, lock_ret;
     int gc_page_signalling = 0;
     int gc_blockers = 0;
+    uword_t start = gc_clock_usec();
 
 #ifdef LOCK_CREATE_THREAD
     /* KLUDGE: Stopping the thread during pthread_create() causes deadlock
@@ -1567,6 +1593,7 @@ void gc_stop_the_world()
                 lose("/gc_stop_the_world: unexpected state");
         }
     }
+    gc_stop_the_world_usec = gc_clock_usec() - start;
     FSHOW_SIGNAL((stderr,"/gc_stop_the_world:end\n"));
 }
 
@@ -1616,6 +1643,23 @@ thread_yield()
     return sched_yield();
 }
 
+/* The number of processors online, which tells Lisp whether spinning
+ * on a held mutex can ever see it released. */
+int
+online_processor_count()
+{
+#if defined(LISP_FEATURE_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (int)n;
+#else
+    return 1;
+#endif
+}
+
 /* If the thread id given does not belong to a running thread (it has
  * exited or never even existed) pthread_kill _may_ fail with ESRCH,
  * but it is also allowed to just segfault, see
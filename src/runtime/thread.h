@@ -65,6 +65,7 @@ extern struct threads_suspend_info suspend_info;
 struct gcing_safety {
     lispobj csp_around_foreign_call;
     lispobj* pc_around_foreign_call;
+    lispobj* fp_around_foreign_call;
 };
 
 #endif
@@ -72,6 +73,7 @@ extern pthread_key_t lisp_thread;
 #endif
 
 extern int thread_yield();
+extern int online_processor_count();
 
 extern int kill_safely(os_thread_t os_thread, int signal);
 
@@ -306,9 +308,11 @@ void push_gcing_safety(struct gcing_safety *into)
         asm volatile ("");
         into->pc_around_foreign_call = th->pc_around_foreign_call;
         th->pc_around_foreign_call = 0;
+        into->fp_around_foreign_call = th->fp_around_foreign_call;
         asm volatile ("");
     } else {
         into->pc_around_foreign_call = 0;
+        into->fp_around_foreign_call = 0;
     }
 }
 
@@ -317,6 +321,7 @@ void pop_gcing_safety(struct gcing_safety *from)
 {
     struct thread* th = arch_os_get_current_thread();
     if (from->csp_around_foreign_call) {
+        th->fp_around_foreign_call = from->fp_around_foreign_call;
         asm volatile ("");
         *th->csp_around_foreign_call = from->csp_around_foreign_call;
         asm volatile ("");
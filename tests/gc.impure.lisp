@@ -105,3 +105,113 @@
     (assert (not (setf (gc-logfile) nil)))
     (assert (not (gc-logfile)))
     (delete-file p)))
+
+;;; Large objects allocated by Lisp threads come out of per-thread
+;;; page caches. Check that they don't step on each other.
+;;; (tests/large-alloc-bench.lisp reports how this scales.)
+(defun cons-large-vectors (n)
+  (let ((keep (make-array 8)))
+    (dotimes (i n)
+      (setf (aref keep (mod i 8))
+            (make-array 200000 :element-type '(unsigned-byte 8)
+                               :initial-element (logand i 255))))
+    ;; The last eight vectors made, each filled with its own index.
+    (loop for v across keep
+          for i from (- n 8)
+          always (every (lambda (x) (= x (logand i 255))) v))))
+
+#+sb-thread
+(with-test (:name (:gc :large-objects :threads))
+  (let ((threads (loop repeat 4
+                       collect (sb-thread:make-thread
+                                (lambda () (cons-large-vectors 256))))))
+    (assert (every #'sb-thread:join-thread threads))))
+
+(with-test (:name (:gc :evacuation-limit) :skipped-on '(not :gencgc))
+  (let* ((gen sb-vm:+highest-normal-generation+)
+         (old (sb-ext:generation-evacuation-limit gen))
+         (list (loop for i below 50
+                     collect (make-list 1000 :initial-element i))))
+    (unwind-protect
+         (progn
+           ;; One page at a time: most of the data stays where it is.
+           (setf (sb-ext:generation-evacuation-limit gen)
+                 sb-vm:gencgc-card-bytes)
+           (dotimes (i 3)
+             (gc :full t)
+             (loop for l in list
+                   for i from 0
+                   do (assert (every (lambda (x) (eql x i)) l)))))
+      (setf (sb-ext:generation-evacuation-limit gen) old))))
+
+(with-test (:name (:gc :pause-target) :skipped-on '(not :gencgc))
+  (let ((nursery (bytes-consed-between-gcs))
+        (promotion (generation-number-of-gcs-before-promotion 0)))
+    (unwind-protect
+         (progn
+           (setf (sb-ext:gc-pause-target) 0.001)
+           (assert (= 0.001 (sb-ext:gc-pause-target)))
+           (let ((keep nil))
+             (dotimes (i 200)
+               (push (make-array 1000) keep)
+               (when (> (length keep) 100)
+                 (setf keep nil))
+               (gc)))
+           ;; Within the limits it moves the nursery between.
+           (assert (<= (* 1024 1024) (bytes-consed-between-gcs)
+                       (max (* 1024 1024)
+                            (floor (sb-ext:dynamic-space-size) 20)))))
+      (setf (sb-ext:gc-pause-target) nil
+            (bytes-consed-between-gcs) nursery
+            (generation-number-of-gcs-before-promotion 0) promotion))
+    (assert (not (sb-ext:gc-pause-target)))))
+
+(with-test (:name (:gc :events) :skipped-on '(not :gencgc))
+  (gc :full t)
+  (let ((events (sb-ext:gc-events)))
+    (assert (<= 1 (length events) 64))
+    (destructuring-bind (&key number generation total generations
+                         &allow-other-keys)
+        (car (last events))
+      (assert (typep number 'unsigned-byte))
+      (assert (= generation sb-vm:+highest-normal-generation+))
+      (assert (typep total 'unsigned-byte))
+      (assert (= (length generations) (1+ generation)))
+      (loop for (gen before survived) in generations
+            for i from 0
+            do (assert (= gen i))
+               (assert (typep before 'unsigned-byte))
+               (assert (typep survived 'unsigned-byte))))
+    (gc)
+    (assert (= (1+ (getf (car (last events)) :number))
+               (getf (car (last (sb-ext:gc-events))) :number)))))
+
+(with-test (:name (:gc :code-stays-put) :skipped-on '(not :gencgc))
+  (let* ((fun (compile nil '(lambda (x) (1+ x))))
+         (address (sb-kernel:get-lisp-obj-address
+                   (sb-kernel:fun-code-header fun))))
+    ;; Some garbage code on the same pages.
+    (dotimes (i 10)
+      (compile nil `(lambda (x) (+ x ,i))))
+    (gc)
+    (gc :full t)
+    (assert (= address (sb-kernel:get-lisp-obj-address
+                        (sb-kernel:fun-code-header fun))))
+    (assert (= 2 (funcall fun 1)))))
+
+(with-test (:name (:gc :precise-stack-slots)
+            :skipped-on '(not (and :x86-64 :sb-gc-safepoint)))
+  (let ((fun (compile nil '(lambda (n)
+                            (let ((list (make-list n :initial-element 'x))
+                                  (string (make-string n :initial-element #\a)))
+                              (gc :full t)
+                              (gc)
+                              (list (length list)
+                                    (every (lambda (x) (eq x 'x)) list)
+                                    string))))))
+    (assert (sb-c::compiled-debug-info-stack-maps
+             (sb-kernel:%code-debug-info (sb-kernel:fun-code-header fun))))
+    (destructuring-bind (length ok string) (funcall fun 1000)
+      (assert (= length 1000))
+      (assert ok)
+      (assert (string= string (make-string 1000 :initial-element #\a))))))
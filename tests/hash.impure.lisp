@@ -388,6 +388,25 @@
                 (setf (gethash key h1) value))
           (sb-ext:gc :full t))))
 
+;;; A chain of entries, each key reachable only as the previous
+;;; entry's value, must survive, however the tables are ordered.
+(with-test (:name (:hash-table :weakness :chain) :skipped-on '(and :c-stack-is-control-stack (not :sb-thread)))
+  (let* ((n 200)
+         (keys (loop repeat (1+ n) collect (list 'key)))
+         (tables (loop repeat n
+                       collect (make-hash-table :test 'eq :weakness :key))))
+    (loop for (key next) on keys
+          for table in (reverse tables)
+          do (setf (gethash key table) next))
+    (let ((first (first keys)))
+      (setf keys nil)
+      (gc :full t)
+      (loop for table in (reverse tables)
+            for key = first then next
+            for next = (gethash key table)
+            do (assert next))
+      (assert (= n (loop for table in tables sum (hash-table-count table)))))))
+
 )
 
 ;;; DEFINE-HASH-TABLE-TEST
@@ -451,4 +470,79 @@
     (assert (= 5 (gethash 1 table)))
     (assert (eq '= (hash-table-test table)))))
 
+;;; Keys with a hash of their own don't make the table ask for a
+;;; rehash when the GC moves them.
+(defclass stably-hashed () ())
+
+(with-test (:name (:hash-table :eq :stable-hash))
+  (let* ((keys (append (loop repeat 100 collect (gensym))
+                       (loop repeat 100 collect (make-instance 'stably-hashed))))
+         (tables (loop for test in '(eq eql equal)
+                       collect (make-hash-table :test test))))
+    (dolist (table tables)
+      (loop for key in keys
+            for i from 0
+            do (setf (gethash key table) i)))
+    (gc)
+    (dolist (table tables)
+      (assert (not (sb-impl::hash-table-needs-rehash-p table)))
+      (loop for key in keys
+            for i from 0
+            do (assert (eql (gethash key table) i)))
+      (loop for key in keys
+            do (assert (remhash key table)))
+      (assert (zerop (hash-table-count table))))))
+
+(defun mod-17= (x y) (= (mod x 17) (mod y 17)))
+(define-hash-table-test mod-17= (lambda (x) (mod x 17)))
+
+(with-test (:name (:hash-table :open-addressing))
+  (dolist (test '(eq eql equal equalp mod-17=))
+    (let ((table (make-hash-table :test test :open-addressing t :size 4))
+          (keys (if (eq test 'mod-17=)
+                    (loop for i below 17 collect i)
+                    (loop for i below 1000
+                          collect (case (mod i 3)
+                                    (0 i)
+                                    (1 (list i))
+                                    (2 (format nil "~D" i)))))))
+      (loop for key in keys
+            for i from 0
+            do (setf (gethash key table) i))
+      (gc)
+      (loop for key in keys
+            for i from 0
+            do (assert (eql (gethash key table) i)))
+      (loop for key in keys
+            for i from 0
+            when (oddp i)
+              do (assert (remhash key table)))
+      (assert (= (hash-table-count table) (ceiling (length keys) 2)))
+      ;; Refill the removed slots, then look everything up again.
+      (loop for key in keys
+            for i from 0
+            when (oddp i)
+              do (setf (gethash key table) (- i)))
+      (loop for key in keys
+            for i from 0
+            do (assert (eql (gethash key table) (if (oddp i) (- i) i))))
+      (let ((n 0))
+        (maphash (lambda (k v) (declare (ignore k v)) (incf n)) table)
+        (assert (= n (length keys) (hash-table-count table))))
+      (clrhash table)
+      (assert (zerop (hash-table-count table)))
+      (assert (null (gethash (first keys) table))))))
+
+(with-test (:name (:hash-table :open-addressing :weakness) :skipped-on '(and :c-stack-is-control-stack (not :sb-thread)))
+  (let ((table (make-hash-table :test 'eq :weakness :key :open-addressing t))
+        (keep (loop repeat 100 collect (list 'keep))))
+    (dolist (key keep)
+      (setf (gethash key table) t))
+    (loop repeat 1000 do (setf (gethash (list 'drop) table) t))
+    (sb-ext:gc :full t)
+    (dolist (key keep)
+      (assert (gethash key table)))
+    ;; Conservative roots may keep a few of the dropped keys alive.
+    (assert (< (hash-table-count table) 200))))
+
 ;;; success
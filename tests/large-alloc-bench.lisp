@@ -0,0 +1,42 @@
+;;;; how allocating large objects from per-thread page caches scales
+;;;; with the number of threads
+;;;;
+;;;; Not part of the regression tests. To run it:
+;;;;   sbcl --script large-alloc-bench.lisp
+
+;;;; This software is part of the SBCL system. See the README file for
+;;;; more information.
+;;;;
+;;;; While most of SBCL is derived from the CMU CL system, the test
+;;;; files (like this one) were written from scratch after the fork
+;;;; from CMU CL.
+;;;;
+;;;; This software is in the public domain and is provided with
+;;;; absolutely no warranty. See the COPYING and CREDITS files for
+;;;; more information.
+
+(in-package :cl-user)
+
+(defun cons-large-vectors (n)
+  (let ((keep (make-array 8)))
+    (dotimes (i n)
+      (setf (aref keep (mod i 8))
+            (make-array 200000 :element-type '(unsigned-byte 8)
+                               :initial-element (logand i 255))))
+    keep))
+
+(defun large-alloc-bench (&key (total 2048)
+                               (thread-counts '(1 2 4 8 16 32 64)))
+  (dolist (n-threads thread-counts)
+    (let* ((start (get-internal-real-time))
+           (threads (loop repeat n-threads
+                          collect (let ((n (ceiling total n-threads)))
+                                    (sb-thread:make-thread
+                                     (lambda () (cons-large-vectors n)))))))
+      (mapc #'sb-thread:join-thread threads)
+      (format t "~&~2D thread~:P: ~,3F s~%"
+              n-threads
+              (/ (- (get-internal-real-time) start)
+                 internal-time-units-per-second)))))
+
+(large-alloc-bench)
@@ -0,0 +1,49 @@
+;;;; throughput of short critical sections on one contended mutex
+;;;;
+;;;; Not part of the regression tests. To run it:
+;;;;   sbcl --script mutex-bench.lisp
+
+;;;; This software is part of the SBCL system. See the README file for
+;;;; more information.
+;;;;
+;;;; While most of SBCL is derived from the CMU CL system, the test
+;;;; files (like this one) were written from scratch after the fork
+;;;; from CMU CL.
+;;;;
+;;;; This software is in the public domain and is provided with
+;;;; absolutely no warranty. See the COPYING and CREDITS files for
+;;;; more information.
+
+(in-package :cl-user)
+
+;;; Sections per second with N-THREADS threads taking the mutex in
+;;; turn for SECONDS, and the mutex's contention statistics.
+(defun mutex-throughput (n-threads seconds)
+  (let* ((mutex (sb-thread:make-mutex :name "throughput"))
+         (counter 0)
+         (stop nil)
+         (go (sb-thread:make-semaphore))
+         (threads (loop repeat n-threads
+                        collect (sb-thread:make-thread
+                                 (lambda ()
+                                   (sb-thread:wait-on-semaphore go)
+                                   (let ((mine 0))
+                                     (loop until stop
+                                           do (sb-thread:with-mutex (mutex)
+                                                (incf counter))
+                                              (incf mine))
+                                     mine))))))
+    (sb-thread:signal-semaphore go n-threads)
+    (sleep seconds)
+    (setf stop t)
+    (let ((total (reduce #'+ (mapcar #'sb-thread:join-thread threads))))
+      (assert (= total counter))
+      (values (round counter seconds)
+              (sb-thread:mutex-statistics mutex)))))
+
+(defun mutex-bench (&key (thread-counts '(2 4 8 16 32 64)) (seconds 0.2))
+  (dolist (n thread-counts)
+    (multiple-value-bind (rate statistics) (mutex-throughput n seconds)
+      (format t "~&~2D threads: ~D sections/s ~S~%" n rate statistics))))
+
+(mutex-bench)
@@ -366,6 +366,101 @@
         (format t "contention ~A ~A~%" kid1 kid2)
         (wait-for-threads (list kid1 kid2))))))
 
+;;; Uncontended use leaves the statistics alone. A waiter which finds
+;;; the mutex held for long spins at most its budget, then sleeps, and
+;;; having slept shortens the next spin. (tests/mutex-bench.lisp
+;;; measures throughput under contention.)
+(with-test (:name (:mutex :statistics)
+            :skipped-on '(not (and :sb-thread :sb-futex)))
+  (let ((mutex (make-mutex :name "statistics")))
+    (dotimes (i 10)
+      (with-mutex (mutex)))
+    (assert (equal (mutex-statistics mutex)
+                   '(:contentions 0 :spin-acquisitions 0
+                     :parks 0 :spin-estimate 0)))
+    (setf (mutex-%spins mutex) 100)
+    (grab-mutex mutex)
+    (let ((kid (make-thread (lambda ()
+                              (with-mutex (mutex) :done)))))
+      ;; Release only once the kid has marked the mutex contested,
+      ;; which it does after spinning, just before going to sleep.
+      (loop until (eql (mutex-state mutex) +lock-contested+)
+            do (sleep 0.01))
+      (release-mutex mutex)
+      (assert (eq :done (join-thread kid))))
+    (destructuring-bind (&key contentions spin-acquisitions parks
+                              spin-estimate)
+        (mutex-statistics mutex)
+      (assert (eql contentions 1))
+      (assert (eql spin-acquisitions 0))
+      (assert (>= parks 1))
+      (assert (eql spin-estimate 75)))))
+
+;;; Readers must never see a writer's half-done update, and writers
+;;; must not lose each other's.
+(with-test (:name (:rwlock :readers-and-writers))
+  (let* ((lock (make-rwlock :name "rwlock"))
+         (a 0)
+         (b 0)
+         (stop nil)
+         (go (make-semaphore))
+         (readers (loop repeat 8
+                        collect (make-thread
+                                 (lambda ()
+                                   (wait-on-semaphore go)
+                                   (let ((reads 0))
+                                     (loop until stop
+                                           do (with-read-lock (lock)
+                                                (assert (= a b)))
+                                              (incf reads))
+                                     reads)))))
+         (writers (loop repeat 4
+                        collect (make-thread
+                                 (lambda ()
+                                   (wait-on-semaphore go)
+                                   (let ((writes 0))
+                                     (loop until stop
+                                           do (with-write-lock (lock)
+                                                (incf a)
+                                                (thread-yield)
+                                                (incf b))
+                                              (incf writes))
+                                     writes))))))
+    (signal-semaphore go 12)
+    (sleep 0.5)
+    (setf stop t)
+    (assert (every #'plusp (mapcar #'join-thread readers)))
+    (let ((writes (reduce #'+ (mapcar #'join-thread writers))))
+      (assert (plusp writes))
+      (assert (= writes a b)))
+    (assert (eq :ok (with-write-lock (lock) :ok)))
+    (assert (eq :ok (with-read-lock (lock) :ok)))))
+
+(with-test (:name (:rwlock :writer-preference))
+  (let* ((lock (make-rwlock))
+         (order '())
+         (order-lock (make-mutex))
+         (writer nil)
+         (reader nil))
+    (flet ((note (what)
+             (with-mutex (order-lock)
+               (push what order))))
+      (with-read-lock (lock)
+        (setf writer (make-thread (lambda ()
+                                    (with-write-lock (lock)
+                                      (note :writer)))))
+        ;; Give the writer time to start waiting for us.
+        (sleep 0.2)
+        (setf reader (make-thread (lambda ()
+                                    (with-read-lock (lock)
+                                      (note :reader)))))
+        (sleep 0.2)
+        ;; The late reader waits behind the writer.
+        (assert (null order)))
+      (join-thread writer)
+      (join-thread reader)
+      (assert (equal '(:reader :writer) order)))))
+
 ;;; GRAB-MUTEX
 
 (with-test (:name (:grab-mutex :waitp nil))